@@ -1,13 +1,34 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "linalg.h"
+#include "numa.h"
 #include "stb_image_write.h"
+#include "texture.h"
+#include "trace.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define IQ_PREVIEW 1
+#include "preview.h"
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
 #include <optional>
 #include <random>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 using namespace std;
@@ -17,48 +38,165 @@ struct Ray;
 struct HitInfo;
 struct Sphere;
 class Material;
+class Medium;
 class Lambertian;
 class Camera;
 class World;
 
 namespace iq {
 float random() {
-  static std::default_random_engine engine;
-  static std::uniform_real_distribution<float> distribution(0, 1);
+  // Every thread draws from its own engine, seeded in creation order.
+  static std::atomic<unsigned> seeds(0);
+  thread_local std::default_random_engine engine(seeds++);
+  thread_local std::uniform_real_distribution<float> distribution(0, 1);
   return distribution(engine);
 }
 
-float3 randomInUnitSphere() {
-  float u = iq::random();
-  float v = iq::random();
+// Conservative bound on the relative rounding error of n chained float
+// operations, see Higham, "Accuracy and Stability of Numerical Algorithms".
+constexpr float gamma(int n) {
+  const float eps = std::numeric_limits<float>::epsilon() * 0.5f;
+  return (n * eps) / (1.0f - n * eps);
+}
+
+// Moves p along the normal far enough to leave the error box pError around
+// the surface, on the side w points to, then rounds away from the surface.
+float3 offsetRayOrigin(const float3 &p, const float3 &pError, const float3 &n,
+                       const float3 &w) {
+  const float d = dot(abs(n), pError);
+  float3 offset = d * n;
+  if (dot(w, n) < 0.0f) {
+    offset = -offset;
+  }
+  float3 po = p + offset;
+  for (int i = 0; i < 3; ++i) {
+    if (offset[i] > 0.0f) {
+      po[i] = std::nextafter(po[i], std::numeric_limits<float>::infinity());
+    } else if (offset[i] < 0.0f) {
+      po[i] = std::nextafter(po[i], -std::numeric_limits<float>::infinity());
+    }
+  }
+  return po;
+}
+
+// Bounces after which radiance() stops extending a path.
+constexpr int maxDepth = 16;
+
+constexpr float pi = 3.14159265358979323846f;
+
+} // namespace iq
+
+// Ray and intersection counters, compiled in with -DIQ_STATS=1. Every thread
+// counts into its own thread_local block, which is merged into the totals
+// when the thread exits, so the hot paths never share a cache line.
+#ifndef IQ_STATS
+#define IQ_STATS 0
+#endif
+
+namespace iq {
+namespace stats {
+constexpr bool enabled = IQ_STATS != 0;
+
+struct Counters {
+  uint64_t raysByDepth[maxDepth + 1] = {};
+  uint64_t intersectionTests = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t scatters = 0;
+  uint64_t depthLimited = 0;
+
+  Counters &operator+=(const Counters &other) {
+    for (int depth = 0; depth <= maxDepth; ++depth) {
+      raysByDepth[depth] += other.raysByDepth[depth];
+    }
+    intersectionTests += other.intersectionTests;
+    hits += other.hits;
+    misses += other.misses;
+    scatters += other.scatters;
+    depthLimited += other.depthLimited;
+    return *this;
+  }
+  uint64_t rays() const { return hits + misses; }
+};
+
+struct Totals {
+  std::mutex mutex;
+  Counters counters;
+};
 
-  const double pi = 3.14159265358979323846;
-  float theta = u * 2.0f * static_cast<float>(pi);
-  float phi = acos(2.0f * v - 1.0f);
-  float r = cbrt(iq::random());
+inline Totals &totals() {
+  static Totals instance;
+  return instance;
+}
 
-  float sinTheta = sin(theta);
-  float cosTheta = cos(theta);
-  float sinPhi = sin(phi);
-  float cosPhi = cos(phi);
+struct Local {
+  Counters counters;
+  ~Local() {
+    Totals &t = totals();
+    std::lock_guard<std::mutex> lock(t.mutex);
+    t.counters += counters;
+  }
+};
 
-  float x = r * sinPhi * cosTheta;
-  float y = r * sinPhi * sinTheta;
-  float z = r * cosPhi;
+// Counters of the calling thread.
+inline Counters &local() {
+  thread_local Local instance;
+  return instance.counters;
+}
 
-  return float3(x, y, z);
+// Counters of all finished threads plus those of the calling thread.
+inline Counters merged() {
+  Totals &t = totals();
+  std::lock_guard<std::mutex> lock(t.mutex);
+  Counters result = t.counters;
+  result += local();
+  return result;
 }
 
-float3 randomInUnitDisk() {
-  float2 point(randomInUnitSphere().xy());
-  return float3(point.x, point.y, 0.0);
+void print(std::ostream &out, const Counters &c, double seconds) {
+  const double rays = double(std::max<uint64_t>(1, c.rays()));
+  out << "Rays " << c.rays() << " (" << c.rays() / seconds * 1e-6
+      << " Mrays/s)\n";
+  for (int depth = 0; depth <= maxDepth && c.raysByDepth[depth] > 0;
+       ++depth) {
+    out << "  depth " << depth << ": " << c.raysByDepth[depth] << "\n";
+  }
+  out << "Intersection tests " << c.intersectionTests << " ("
+      << c.intersectionTests / rays << " per ray)\n"
+      << "Hits " << c.hits << ", misses " << c.misses << " (hit ratio "
+      << c.hits / rays << ")\n"
+      << "Scatters " << c.scatters << "\n"
+      << "Paths terminated by depth limit " << c.depthLimited << std::endl;
 }
 
+bool writeJson(const string &filename, const Counters &c, double seconds) {
+  std::ofstream file(filename);
+  file << "{\n  \"seconds\": " << seconds << ",\n  \"rays\": " << c.rays()
+       << ",\n  \"raysByDepth\": [";
+  for (int depth = 0; depth <= maxDepth; ++depth) {
+    file << (depth > 0 ? ", " : "") << c.raysByDepth[depth];
+  }
+  file << "],\n  \"intersectionTests\": " << c.intersectionTests
+       << ",\n  \"hits\": " << c.hits << ",\n  \"misses\": " << c.misses
+       << ",\n  \"scatters\": " << c.scatters
+       << ",\n  \"depthLimited\": " << c.depthLimited << "\n}\n";
+  return bool(file);
+}
+} // namespace stats
 } // namespace iq
 
 struct Ray {
   float3 org;
   float3 dir;
+  // Ray cone for texture filtering (Akenine-Moller et al., "Texture Level
+  // of Detail Strategies for Real-Time Ray Tracing", 2019): footprint width
+  // at the origin and its growth per unit distance along a unit dir.
+  float width = 0.0f;
+  float spread = 0.0f;
+  // Medium the ray travels through, null for vacuum.
+  const Medium *medium = nullptr;
+  // Time within the shutter interval [0, 1).
+  float time = 0.0f;
   Ray() {}
   Ray(float3 o, float3 d) : org(o), dir(d) {}
   float3 pointAt(const float t) const { return org + t * dir; }
@@ -67,78 +205,833 @@ struct Ray {
 struct HitInfo {
   float t;
   float3 p;
+  float3 pError;
   float3 normal;
   Material *material;
-  HitInfo(float t, float3 p, float3 normal, Material *material)
-      : t(t), p(p), normal(normal), material(material) {}
+  // Index of the sphere in its World.
+  uint32_t primitive = 0;
+  // Surface parameterization and the width of the ray footprint in u.
+  float2 uv = float2(0.0f);
+  float uvWidth = 0.0f;
+  // Width of the incoming ray cone at p and its spread.
+  float width = 0.0f;
+  float spread = 0.0f;
+  float time = 0.0f;
+  HitInfo(float t, float3 p, float3 pError, float3 normal, Material *material)
+      : t(t), p(p), pError(pError), normal(normal), material(material) {}
+  // Rays leaving the surface start outside the error bounds of p so they
+  // cannot re-hit the primitive they were spawned from. They continue the
+  // incoming cone; rough lobes widen it with a larger spread.
+  Ray spawn(const float3 &dir, float spread) const {
+    Ray ray(iq::offsetRayOrigin(p, pError, normal, dir), dir);
+    ray.width = width;
+    ray.spread = spread;
+    ray.time = time;
+    return ray;
+  }
 };
 
+// Spheres move linearly from m_pos at the start of the shutter interval to
+// m_pos1 at its end.
 struct Sphere {
   float3 m_pos;
+  float3 m_pos1;
   float m_radius;
-  std::shared_ptr<Material> m_material;
-  Sphere(float3 p, float r, std::shared_ptr<Material> material)
-      : m_pos(p), m_radius(r), m_material(std::move(material)) {}
-  std::optional<HitInfo> intersect(const Ray &ray, float tmin,
-                                   float tmax) const {
-    const float3 oc = ray.org - m_pos;
+  // Owned by the arena of the world the sphere was created for.
+  Material *m_material;
+  Sphere(float3 p, float r, Material *material)
+      : m_pos(p), m_pos1(p), m_radius(r), m_material(material) {}
+  Sphere(float3 p0, float3 p1, float r, Material *material)
+      : m_pos(p0), m_pos1(p1), m_radius(r), m_material(material) {}
+  // Exactly m_pos for static spheres.
+  float3 center(float time) const { return m_pos + (m_pos1 - m_pos) * time; }
+  // Distance-only test used during traversal; the surface interaction is
+  // built afterwards by interaction() for the nearest hit only.
+  bool intersect(const Ray &ray, float tmin, float tmax, float &t) const {
+    if constexpr (iq::stats::enabled) {
+      ++iq::stats::local().intersectionTests;
+    }
+    const float3 oc = ray.org - center(ray.time);
     const float a = dot(ray.dir, ray.dir);
     const float b = dot(oc, ray.dir);
     const float c = dot(oc, oc) - m_radius * m_radius;
     const float discriminant = b * b - a * c;
     if (discriminant > 0.0f) {
-      float temp = (-b - sqrt(discriminant)) / a;
+      const float root = sqrt(discriminant);
+      float temp = (-b - root) / a;
       if (temp < tmax && temp > tmin) {
-        const float3 _pos = ray.pointAt(temp);
-        auto info = std::make_optional<HitInfo>(
-            temp, _pos, (_pos - m_pos) / m_radius, m_material.get());
-        return info;
+        t = temp;
+        return true;
       }
-      temp = (-b + sqrt(discriminant)) / a;
+      temp = (-b + root) / a;
       if (temp < tmax && temp > tmin) {
-        const float3 _pos = ray.pointAt(temp);
-        auto info = std::make_optional<HitInfo>(
-            temp, _pos, (_pos - m_pos) / m_radius, m_material.get());
-        return info;
+        t = temp;
+        return true;
+      }
+    }
+    return false;
+  }
+  HitInfo interaction(const Ray &ray, float t) const {
+    // Reproject onto the surface, which bounds the error independently of
+    // the ray parameter t.
+    const float3 c = center(ray.time);
+    float3 local = ray.pointAt(t) - c;
+    local *= m_radius / length(local);
+    const float3 _pos = c + local;
+    const float3 pError = iq::gamma(5) * abs(local) +
+                          iq::gamma(1) * (abs(c) + abs(local));
+    const float3 normal = local / m_radius;
+    HitInfo info(t, _pos, pError, normal, m_material);
+    // Longitude and latitude, u around the y axis and v from the bottom.
+    info.uv = float2((std::atan2(-normal.z, normal.x) + iq::pi) / (2 * iq::pi),
+                     std::acos(std::clamp(-normal.y, -1.0f, 1.0f)) / iq::pi);
+    info.width = ray.width + ray.spread * t;
+    info.spread = ray.spread;
+    info.time = ray.time;
+    // Parallels shrink towards the poles; the larger extent picks the lod.
+    const float sinTheta = std::sqrt(std::max(1.0f - normal.y * normal.y,
+                                              1e-6f));
+    info.uvWidth = info.width / (iq::pi * m_radius) *
+                   std::max(0.5f / sinTheta, 1.0f);
+    return info;
+  }
+};
+
+// Result of sampling a BSDF. The path throughput is scaled by
+// f * |cos(wi, n)| / pdf; delta lobes report pdf 1 and fold the cosine
+// into f.
+struct BsdfSample {
+  float3 wi;
+  float3 f;
+  float pdf;
+  bool specular;
+};
+
+namespace iq {
+// Orthonormal basis around a unit normal (Duff et al., "Building an
+// Orthonormal Basis, Revisited", 2017); local z is the normal.
+struct Frame {
+  float3 s, t, n;
+  explicit Frame(const float3 &normal) : n(normal) {
+    const float sign = std::copysign(1.0f, n.z);
+    const float a = -1.0f / (sign + n.z);
+    const float b = n.x * n.y * a;
+    s = float3(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    t = float3(b, sign + n.y * n.y * a, -n.y);
+  }
+  float3 toLocal(const float3 &v) const {
+    return float3(dot(v, s), dot(v, t), dot(v, n));
+  }
+  float3 toWorld(const float3 &v) const { return v.x * s + v.y * t + v.z * n; }
+};
+
+// Uniform point on the unit disk by the low distortion concentric map of
+// Shirley and Chiu, which keeps strata of u compact on the disk.
+inline float2 sampleConcentricDisk(const float2 &u) {
+  const float2 d = 2.0f * u - 1.0f;
+  if (d.x == 0.0f && d.y == 0.0f) {
+    return float2(0.0f);
+  }
+  const bool horizontal = std::abs(d.x) > std::abs(d.y);
+  const float r = horizontal ? d.x : d.y;
+  const float phi = horizontal ? 0.25f * pi * (d.y / d.x)
+                               : 0.5f * pi - 0.25f * pi * (d.x / d.y);
+  return r * float2(std::cos(phi), std::sin(phi));
+}
+
+// Uniform point on the regular polygon with the given number of sides
+// inscribed in the unit circle: u.x picks the triangle between the center
+// and one side and, rescaled, the distance from the center within it.
+inline float2 samplePolygon(const float2 &u, int sides) {
+  const float scaled = u.x * float(sides);
+  const int side = std::min(int(scaled), sides - 1);
+  const float angle = 2.0f * pi / float(sides);
+  const float2 a(std::cos(side * angle), std::sin(side * angle));
+  const float2 b(std::cos((side + 1) * angle), std::sin((side + 1) * angle));
+  return std::sqrt(scaled - float(side)) * (a + (b - a) * u.y);
+}
+
+inline float3 sampleCosineHemisphere(const float2 &u) {
+  const float r = std::sqrt(u.x);
+  const float phi = 2.0f * pi * u.y;
+  return float3(r * std::cos(phi), r * std::sin(phi),
+                std::sqrt(std::max(0.0f, 1.0f - u.x)));
+}
+
+// Uniform direction within the cone of cos(theta) >= cosMax around +z.
+// oneMinusCosMax is passed separately to keep precision for tiny cones.
+inline float3 sampleUniformCone(const float2 &u, float oneMinusCosMax) {
+  const float cosTheta = 1.0f - u.x * oneMinusCosMax;
+  const float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+  const float phi = 2.0f * pi * u.y;
+  return float3(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+}
+
+inline float luminance(const float3 &c) {
+  return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+inline float3 fresnelSchlick(const float3 &f0, float cosTheta) {
+  const float m = std::clamp(1.0f - cosTheta, 0.0f, 1.0f);
+  const float m2 = m * m;
+  return f0 + (float3(1.0f) - f0) * (m2 * m2 * m);
+}
+
+// Unpolarized Fresnel reflectance of a dielectric interface, eta is the
+// ratio of the refractive indices behind and in front of it.
+inline float fresnelDielectric(float cosThetaI, float eta) {
+  const float sin2ThetaT = (1.0f - cosThetaI * cosThetaI) / (eta * eta);
+  if (sin2ThetaT >= 1.0f) {
+    return 1.0f; // total internal reflection
+  }
+  const float cosThetaT = std::sqrt(1.0f - sin2ThetaT);
+  const float rs =
+      (cosThetaI - eta * cosThetaT) / (cosThetaI + eta * cosThetaT);
+  const float rp =
+      (eta * cosThetaI - cosThetaT) / (eta * cosThetaI + cosThetaT);
+  return 0.5f * (rs * rs + rp * rp);
+}
+
+// Trowbridge-Reitz (GGX) microfacet distribution with the height-correlated
+// Smith masking-shadowing term, in the local frame of the surface.
+namespace ggx {
+inline float d(const float3 &h, float alpha) {
+  const float a2 = alpha * alpha;
+  const float t = h.z * h.z * (a2 - 1.0f) + 1.0f;
+  return a2 / (pi * t * t);
+}
+
+inline float lambda(const float3 &w, float alpha) {
+  const float cos2 = w.z * w.z;
+  const float tan2 = std::max(0.0f, 1.0f - cos2) / std::max(cos2, 1e-12f);
+  return 0.5f * (std::sqrt(1.0f + alpha * alpha * tan2) - 1.0f);
+}
+
+// Visible normal sampling (Heitz, "Sampling the GGX Distribution of Visible
+// Normals", JCGT 2018).
+inline float3 sampleVisibleNormal(const float3 &wo, float alpha,
+                                  const float2 &u) {
+  const float3 v = normalize(float3(alpha * wo.x, alpha * wo.y, wo.z));
+  const float lengthSquared = v.x * v.x + v.y * v.y;
+  const float3 t1 = lengthSquared > 0.0f
+                        ? float3(-v.y, v.x, 0.0f) / std::sqrt(lengthSquared)
+                        : float3(1.0f, 0.0f, 0.0f);
+  const float3 t2 = cross(v, t1);
+  const float r = std::sqrt(u.x);
+  const float phi = 2.0f * pi * u.y;
+  const float p1 = r * std::cos(phi);
+  const float s = 0.5f * (1.0f + v.z);
+  const float p2 =
+      (1.0f - s) * std::sqrt(1.0f - p1 * p1) + s * r * std::sin(phi);
+  const float3 n = p1 * t1 + p2 * t2 +
+                   std::sqrt(std::max(0.0f, 1.0f - p1 * p1 - p2 * p2)) * v;
+  return normalize(float3(alpha * n.x, alpha * n.y, std::max(0.0f, n.z)));
+}
+
+// Single-scattering reflectance of a white GGX surface, E(cos, alpha), and
+// its cosine-weighted average Eavg(alpha), tabulated once for the
+// multiple-scattering compensation of Kulla and Conty ("Revisiting Physically
+// Based Shading at Imageworks", 2017).
+class EnergyTable {
+public:
+  static constexpr int size = 32;
+
+  static const EnergyTable &get() {
+    static const EnergyTable table;
+    return table;
+  }
+
+  float e(float cosTheta, float alpha) const {
+    return lookup(m_e, cosTheta, alpha);
+  }
+  float average(float alpha) const {
+    const float a = std::clamp(alpha, 0.0f, 1.0f) * (size - 1);
+    const int i = std::min(int(a), size - 2);
+    return m_average[i] + (m_average[i + 1] - m_average[i]) * (a - float(i));
+  }
+
+private:
+  EnergyTable() {
+    const int samples = 1024;
+    for (int j = 0; j < size; ++j) {
+      const float alpha = std::max(float(j) / (size - 1), 1e-3f);
+      for (int i = 0; i < size; ++i) {
+        const float cosTheta = std::max(float(i) / (size - 1), 1e-3f);
+        const float3 wo(std::sqrt(1.0f - cosTheta * cosTheta), 0.0f,
+                        cosTheta);
+        // Stratified in u.x, radical inverse in u.y; the estimator of the
+        // visible normal sampler is G2 / G1.
+        float e = 0.0f;
+        for (int k = 0; k < samples; ++k) {
+          uint32_t bits = uint32_t(k);
+          bits = (bits << 16) | (bits >> 16);
+          bits = ((bits & 0x55555555u) << 1) | ((bits & 0xaaaaaaaau) >> 1);
+          bits = ((bits & 0x33333333u) << 2) | ((bits & 0xccccccccu) >> 2);
+          bits = ((bits & 0x0f0f0f0fu) << 4) | ((bits & 0xf0f0f0f0u) >> 4);
+          bits = ((bits & 0x00ff00ffu) << 8) | ((bits & 0xff00ff00u) >> 8);
+          const float2 u((float(k) + 0.5f) / samples, float(bits) * 0x1p-32f);
+          const float3 h = sampleVisibleNormal(wo, alpha, u);
+          const float3 wi = 2.0f * dot(wo, h) * h - wo;
+          if (wi.z > 0.0f) {
+            const float lo = lambda(wo, alpha), li = lambda(wi, alpha);
+            e += (1.0f + lo) / (1.0f + lo + li);
+          }
+        }
+        m_e[i + j * size] = e / samples;
+      }
+      // Integrated over the interpolated table so that the compensation
+      // lobe conserves energy exactly for a white surface.
+      const int steps = 16 * size;
+      float average = 0.0f;
+      for (int k = 0; k < steps; ++k) {
+        const float cosTheta = (float(k) + 0.5f) / steps;
+        average += 2.0f * e(cosTheta, float(j) / (size - 1)) * cosTheta / steps;
+      }
+      m_average[j] = std::min(average, 1.0f);
+    }
+  }
+
+  static float lookup(const float *table, float cosTheta, float alpha) {
+    const float x = std::clamp(cosTheta, 0.0f, 1.0f) * (size - 1);
+    const float y = std::clamp(alpha, 0.0f, 1.0f) * (size - 1);
+    const int i = std::min(int(x), size - 2), j = std::min(int(y), size - 2);
+    const float fx = x - float(i), fy = y - float(j);
+    const float *row = table + j * size;
+    const float top = row[i] + (row[i + 1] - row[i]) * fx;
+    const float bottom =
+        row[i + size] + (row[i + size + 1] - row[i + size]) * fx;
+    return top + (bottom - top) * fy;
+  }
+
+  float m_e[size * size];
+  float m_average[size];
+};
+} // namespace ggx
+
+// Henyey-Greenstein phase function, g the mean cosine of scattering. Both
+// take the cosine between the incoming and outgoing propagation directions.
+inline float henyeyGreenstein(float cosTheta, float g) {
+  const float denominator = 1.0f + g * g - 2.0f * g * cosTheta;
+  return (1.0f - g * g) /
+         (4.0f * pi * denominator * std::sqrt(std::max(denominator, 0.0f)));
+}
+
+// Propagation direction after scattering a ray travelling along dir.
+inline float3 sampleHenyeyGreenstein(const float3 &dir, float g,
+                                     const float2 &u) {
+  float cosTheta;
+  if (std::abs(g) < 1e-3f) {
+    cosTheta = 1.0f - 2.0f * u.x;
+  } else {
+    const float s = (1.0f - g * g) / (1.0f - g + 2.0f * g * u.x);
+    cosTheta = (1.0f + g * g - s * s) / (2.0f * g);
+  }
+  const float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+  const float phi = 2.0f * pi * u.y;
+  return Frame(dir).toWorld(float3(sinTheta * std::cos(phi),
+                                   sinTheta * std::sin(phi), cosTheta));
+}
+} // namespace iq
+
+// Participating medium filling the inside of spheres whose material is a
+// MediumBoundary. Extinction is grey, scattering has a color (the single
+// scattering albedo) and a Henyey-Greenstein phase function. Rays passed
+// in have unit directions.
+class Medium {
+public:
+  Medium(const float3 &albedo, float g) : m_albedo(albedo), m_g(g) {}
+  virtual ~Medium() {}
+  // Free-flight sampling: a real collision before tmax, at which the path
+  // scatters with throughput weight, or false if the ray gets through.
+  virtual bool sample(const Ray &ray, float tmax, float &t,
+                      float3 &weight) const = 0;
+  // Unbiased estimate of the transmittance from the origin to tmax.
+  virtual float transmittance(const Ray &ray, float tmax) const = 0;
+
+  float phase(const float3 &wo, const float3 &wi) const {
+    return iq::henyeyGreenstein(dot(-wo, wi), m_g);
+  }
+  // wi scattered from a ray arriving from wo, pdf equal to phase().
+  float3 samplePhase(const float3 &wo, const float2 &u) const {
+    return iq::sampleHenyeyGreenstein(-wo, m_g, u);
+  }
+
+protected:
+  float3 m_albedo;
+  float m_g;
+};
+
+// Constant density: closed-form free flights and transmittance.
+class HomogeneousMedium : public Medium {
+public:
+  HomogeneousMedium(float sigmaT, const float3 &albedo, float g = 0.0f)
+      : Medium(albedo, g), m_sigmaT(sigmaT) {}
+  virtual bool sample(const Ray &ray, float tmax, float &t,
+                      float3 &weight) const {
+    const float s = -std::log(1.0f - iq::random()) / m_sigmaT;
+    if (s >= tmax) {
+      return false;
+    }
+    t = s;
+    weight = m_albedo;
+    return true;
+  }
+  virtual float transmittance(const Ray &ray, float tmax) const {
+    return std::exp(-m_sigmaT * tmax);
+  }
+
+private:
+  float m_sigmaT;
+};
+
+// Density on a grid of n^3 points spanning the cube around a sphere,
+// trilinearly interpolated and scaled by sigmaT. Free flights use delta
+// tracking and transmittance ratio tracking (Novak et al., "Residual Ratio
+// Tracking for Estimating Attenuation in Participating Media", 2014), both
+// against a coarse grid of per-cell density maxima walked with a 3D DDA,
+// so thin regions take long steps and empty cells none at all.
+class GridMedium : public Medium {
+public:
+  // density maps points of [-1, 1]^3 to [0, 1].
+  GridMedium(const float3 &center, float radius, size_t n, float sigmaT,
+             const std::function<float(const float3 &)> &density,
+             const float3 &albedo, float g = 0.0f)
+      : Medium(albedo, g), m_lo(center - float3(radius)),
+        m_size(2.0f * radius), m_n(n), m_sigmaT(sigmaT),
+        m_density(n * n * n), m_majorants(cells * cells * cells, 0.0f) {
+    for (size_t z = 0; z < n; ++z) {
+      for (size_t y = 0; y < n; ++y) {
+        for (size_t x = 0; x < n; ++x) {
+          const float3 p = float3(float(x), float(y), float(z)) /
+                               float(n - 1) * 2.0f -
+                           1.0f;
+          m_density[x + n * (y + n * z)] = std::clamp(density(p), 0.0f, 1.0f);
+        }
+      }
+    }
+    // Interpolated values are bounded by the grid points of their voxel,
+    // so every point bounds the cells its neighbouring voxels overlap.
+    const float cellsPerVoxel = float(cells) / float(n - 1);
+    const auto range = [&](size_t i) {
+      const float first =
+          std::floor(float(std::max<size_t>(i, 1) - 1) * cellsPerVoxel);
+      const float last = std::ceil(float(i + 1) * cellsPerVoxel) - 1.0f;
+      return std::make_pair(size_t(first),
+                            std::min(size_t(last), cells - 1));
+    };
+    for (size_t z = 0; z < n; ++z) {
+      for (size_t y = 0; y < n; ++y) {
+        for (size_t x = 0; x < n; ++x) {
+          const float value = m_density[x + n * (y + n * z)];
+          const auto rx = range(x), ry = range(y), rz = range(z);
+          for (size_t k = rz.first; k <= rz.second; ++k) {
+            for (size_t j = ry.first; j <= ry.second; ++j) {
+              for (size_t i = rx.first; i <= rx.second; ++i) {
+                float &majorant = m_majorants[i + cells * (j + cells * k)];
+                majorant = std::max(majorant, value);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  virtual bool sample(const Ray &ray, float tmax, float &t,
+                      float3 &weight) const {
+    bool scattered = false;
+    traverse(ray, tmax, [&](float t0, float t1, float majorant) {
+      for (float s = t0;;) {
+        s -= std::log(1.0f - iq::random()) / (majorant * m_sigmaT);
+        if (s >= t1) {
+          return true;
+        }
+        if (iq::random() * majorant < density(ray.pointAt(s))) {
+          t = s;
+          scattered = true;
+          return false;
+        }
+      }
+    });
+    weight = m_albedo;
+    return scattered;
+  }
+
+  virtual float transmittance(const Ray &ray, float tmax) const {
+    float transmittance = 1.0f;
+    traverse(ray, tmax, [&](float t0, float t1, float majorant) {
+      for (float s = t0;;) {
+        s -= std::log(1.0f - iq::random()) / (majorant * m_sigmaT);
+        if (s >= t1) {
+          return true;
+        }
+        transmittance *= 1.0f - density(ray.pointAt(s)) / majorant;
+      }
+    });
+    return transmittance;
+  }
+
+private:
+  static constexpr size_t cells = 16;
+
+  float density(const float3 &p) const {
+    const float3 g = clamp((p - m_lo) / m_size, 0.0f, 1.0f) * float(m_n - 1);
+    const size_t x = std::min(size_t(g.x), m_n - 2);
+    const size_t y = std::min(size_t(g.y), m_n - 2);
+    const size_t z = std::min(size_t(g.z), m_n - 2);
+    const float3 f = g - float3(float(x), float(y), float(z));
+    const auto at = [&](size_t i, size_t j, size_t k) {
+      return m_density[(x + i) + m_n * ((y + j) + m_n * (z + k))];
+    };
+    const auto lerp = [](float a, float b, float t) { return a + (b - a) * t; };
+    return lerp(lerp(lerp(at(0, 0, 0), at(1, 0, 0), f.x),
+                     lerp(at(0, 1, 0), at(1, 1, 0), f.x), f.y),
+                lerp(lerp(at(0, 0, 1), at(1, 0, 1), f.x),
+                     lerp(at(0, 1, 1), at(1, 1, 1), f.x), f.y),
+                f.z);
+  }
+
+  // Calls visit(t0, t1, majorant) for the majorant cells the ray crosses
+  // before tmax, in order, skipping empty ones, until visit returns false.
+  template <typename Visit>
+  void traverse(const Ray &ray, float tmax, const Visit &visit) const {
+    // Cell coordinates, the box spanning [0, cells]^3.
+    const float scale = float(cells) / m_size;
+    const float3 o = (ray.org - m_lo) * scale;
+    const float3 d = ray.dir * scale;
+    float t0 = 0.0f, t1 = tmax;
+    for (int a = 0; a < 3; ++a) {
+      const float inv = 1.0f / d[a];
+      float near = (0.0f - o[a]) * inv, far = (float(cells) - o[a]) * inv;
+      if (near > far) {
+        std::swap(near, far);
+      }
+      t0 = std::max(t0, near);
+      t1 = std::min(t1, far);
+    }
+    if (!(t0 < t1)) {
+      return;
+    }
+    int cell[3], step[3];
+    float next[3], delta[3];
+    const float3 start = o + d * t0;
+    for (int a = 0; a < 3; ++a) {
+      cell[a] = std::clamp(int(start[a]), 0, int(cells) - 1);
+      step[a] = d[a] > 0.0f ? 1 : -1;
+      delta[a] = std::abs(1.0f / d[a]);
+      next[a] = d[a] == 0.0f ? numeric_limits<float>::infinity()
+                             : (float(cell[a] + (d[a] > 0.0f)) - o[a]) / d[a];
+    }
+    while (t0 < t1) {
+      const int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2)
+                                      : (next[1] < next[2] ? 1 : 2);
+      const float end = std::min(next[a], t1);
+      const float majorant =
+          m_majorants[cell[0] + cells * (cell[1] + cells * cell[2])];
+      if (majorant > 0.0f && !visit(t0, end, majorant)) {
+        return;
+      }
+      t0 = end;
+      cell[a] += step[a];
+      if (cell[a] < 0 || cell[a] >= int(cells)) {
+        return;
       }
+      next[a] += delta[a];
     }
-    return {};
   }
+
+  float3 m_lo;
+  float m_size;
+  size_t m_n;
+  float m_sigmaT;
+  vector<float> m_density;
+  vector<float> m_majorants; // cells^3
 };
 
+// Surface scattering as a BSDF with sampling, evaluation and pdf. Directions
+// are in world space and point away from the surface; wo leads back along
+// the path towards the camera.
 class Material {
 public:
   virtual ~Material() {}
-  virtual bool scatter(const Ray &in, const HitInfo &info, float3 &attenuation,
-                       Ray &scattered) const = 0;
+  // Draws wi from u in [0, 1)^2, returns false if the path ends here.
+  virtual bool sample(const HitInfo &info, const float3 &wo, const float2 &u,
+                      BsdfSample &sample) const = 0;
+  // Both are zero for delta lobes, which only sample() can produce.
+  virtual float3 eval(const HitInfo &info, const float3 &wo,
+                      const float3 &wi) const = 0;
+  virtual float pdf(const HitInfo &info, const float3 &wo,
+                    const float3 &wi) const = 0;
+  // Reflectance feature for the albedo AOV.
+  virtual float3 albedo(const HitInfo &info) const = 0;
+  // Radiance leaving the surface on its own, the same in all directions.
+  virtual float3 emission() const { return float3(0.0f); }
+  // True if all lobes are delta lobes.
+  virtual bool delta() const { return false; }
+  // True for Lambertian reflectors, whose light the radiance cache stores.
+  virtual bool diffuse() const { return false; }
+  // Index-matched boundaries between media pass rays through unchanged.
+  // The outside is the side the normal points to, null is vacuum.
+  virtual bool boundary() const { return false; }
+  virtual const Medium *inside() const { return nullptr; }
+  virtual const Medium *outside() const { return nullptr; }
+
+  // Identifier for the material id AOV, 0 is reserved for the background.
+  uint32_t id() const { return m_id; }
+  void setId(uint32_t id) { m_id = id; }
+
+private:
+  uint32_t m_id = 0;
 };
 
+// Diffuse reflector; an optional texture modulates the albedo.
 class Lambertian : public Material {
 public:
-  Lambertian(const float3 &albedo) : m_albedo(albedo) {}
-  virtual bool scatter(const Ray &in, const HitInfo &info, float3 &attenuation,
-                       Ray &scattered) const {
-    const float3 target = info.p + info.normal + iq::randomInUnitSphere();
-    scattered = Ray(info.p, target - info.p);
-    attenuation = m_albedo;
+  Lambertian(const float3 &albedo,
+             const iq::texture::Texture *texture = nullptr)
+      : m_albedo(albedo), m_texture(texture) {}
+  virtual bool sample(const HitInfo &info, const float3 &wo, const float2 &u,
+                      BsdfSample &sample) const {
+    const iq::Frame frame(dot(wo, info.normal) < 0.0f ? -info.normal
+                                                        : info.normal);
+    const float3 local = iq::sampleCosineHemisphere(u);
+    if (local.z <= 0.0f) {
+      return false;
+    }
+    sample = {frame.toWorld(local), albedo(info) / iq::pi, local.z / iq::pi,
+              false};
     return true;
   }
+  virtual float3 eval(const HitInfo &info, const float3 &wo,
+                      const float3 &wi) const {
+    const bool sameSide =
+        dot(wo, info.normal) * dot(wi, info.normal) > 0.0f;
+    return sameSide ? albedo(info) / iq::pi : float3(0.0f);
+  }
+  virtual float pdf(const HitInfo &info, const float3 &wo,
+                    const float3 &wi) const {
+    const float cosI = dot(wi, info.normal);
+    return dot(wo, info.normal) * cosI > 0.0f ? std::abs(cosI) / iq::pi
+                                              : 0.0f;
+  }
+  virtual float3 albedo(const HitInfo &info) const {
+    return m_texture != nullptr
+               ? m_albedo * m_texture->sample(info.uv, info.uvWidth)
+               : m_albedo;
+  }
+  virtual bool diffuse() const { return true; }
 
 private:
   float3 m_albedo;
+  const iq::texture::Texture *m_texture;
+};
+
+// Metal with Schlick Fresnel from its normal-incidence reflectance f0.
+// Roughness 0 is a perfect mirror, otherwise GGX with alpha = roughness^2
+// plus the energy lost to single scattering added back as a diffuse-like
+// multiple-scattering lobe from the precomputed energy table.
+class Conductor : public Material {
+public:
+  Conductor(const float3 &f0, float roughness)
+      : m_f0(f0), m_alpha(roughness * roughness) {}
+  virtual bool sample(const HitInfo &info, const float3 &wo, const float2 &u,
+                      BsdfSample &sample) const {
+    const iq::Frame frame(info.normal);
+    const float3 o = frame.toLocal(wo);
+    if (o.z <= 0.0f) {
+      return false;
+    }
+    if (specular()) {
+      const float3 i(-o.x, -o.y, o.z);
+      sample = {frame.toWorld(i), iq::fresnelSchlick(m_f0, o.z) / i.z, 1.0f,
+                true};
+      return true;
+    }
+    // Pick the multiple-scattering lobe with the probability of its white
+    // albedo, 1 - E, and sample it like a diffuse surface.
+    const float multiple = multipleProbability(o);
+    float3 i;
+    if (u.x < multiple) {
+      i = iq::sampleCosineHemisphere(float2(u.x / multiple, u.y));
+    } else {
+      const float2 v((u.x - multiple) / (1.0f - multiple), u.y);
+      const float3 h = iq::ggx::sampleVisibleNormal(o, m_alpha, v);
+      i = 2.0f * dot(o, h) * h - o;
+    }
+    if (i.z <= 0.0f) {
+      return false;
+    }
+    sample = {frame.toWorld(i), evalLocal(o, i), pdfLocal(o, i), false};
+    return sample.pdf > 0.0f;
+  }
+  virtual float3 eval(const HitInfo &info, const float3 &wo,
+                      const float3 &wi) const {
+    const iq::Frame frame(info.normal);
+    const float3 o = frame.toLocal(wo), i = frame.toLocal(wi);
+    return specular() || o.z <= 0.0f || i.z <= 0.0f ? float3(0.0f)
+                                                     : evalLocal(o, i);
+  }
+  virtual float pdf(const HitInfo &info, const float3 &wo,
+                    const float3 &wi) const {
+    const iq::Frame frame(info.normal);
+    const float3 o = frame.toLocal(wo), i = frame.toLocal(wi);
+    return specular() || o.z <= 0.0f || i.z <= 0.0f ? 0.0f : pdfLocal(o, i);
+  }
+  virtual float3 albedo(const HitInfo &info) const { return m_f0; }
+  virtual bool delta() const { return specular(); }
+
+private:
+  bool specular() const { return m_alpha < 1e-3f; }
+
+  float3 evalLocal(const float3 &o, const float3 &i) const {
+    using namespace iq::ggx;
+    const float3 h = normalize(o + i);
+    const float g2 =
+        1.0f / (1.0f + lambda(o, m_alpha) + lambda(i, m_alpha));
+    const float3 single = iq::fresnelSchlick(m_f0, dot(o, h)) *
+                          (d(h, m_alpha) * g2 / (4.0f * o.z * i.z));
+
+    const EnergyTable &table = EnergyTable::get();
+    const float average = table.average(m_alpha);
+    const float3 fresnelAverage = m_f0 * (20.0f / 21.0f) + 1.0f / 21.0f;
+    const float3 fresnelMultiple =
+        fresnelAverage * fresnelAverage * average /
+        (float3(1.0f) - fresnelAverage * (1.0f - average));
+    const float multiple = (1.0f - table.e(o.z, m_alpha)) *
+                           (1.0f - table.e(i.z, m_alpha)) /
+                           (iq::pi * std::max(1.0f - average, 1e-4f));
+    return single + fresnelMultiple * multiple;
+  }
+  float multipleProbability(const float3 &o) const {
+    return std::clamp(1.0f - iq::ggx::EnergyTable::get().e(o.z, m_alpha),
+                      0.0f, 0.999f);
+  }
+  // Mixture of the reflected visible normal density and the cosine density.
+  float pdfLocal(const float3 &o, const float3 &i) const {
+    using namespace iq::ggx;
+    const float3 h = normalize(o + i);
+    const float g1 = 1.0f / (1.0f + lambda(o, m_alpha));
+    const float multiple = multipleProbability(o);
+    return (1.0f - multiple) * g1 * d(h, m_alpha) / (4.0f * o.z) +
+           multiple * i.z / iq::pi;
+  }
+
+  float3 m_f0;
+  float m_alpha;
+};
+
+// Smooth glass: Fresnel weighted choice between mirror reflection and
+// refraction, with an optional transmission tint.
+class Dielectric : public Material {
+public:
+  Dielectric(float eta, const float3 &tint = float3(1.0f))
+      : m_eta(eta), m_tint(tint) {}
+  virtual bool sample(const HitInfo &info, const float3 &wo, const float2 &u,
+                      BsdfSample &sample) const {
+    const bool entering = dot(wo, info.normal) > 0.0f;
+    const float3 n = entering ? info.normal : -info.normal;
+    const float eta = entering ? m_eta : 1.0f / m_eta;
+    const float cosI = dot(wo, n);
+    const float reflectance = iq::fresnelDielectric(cosI, eta);
+    if (u.x < reflectance) {
+      const float3 wi = 2.0f * cosI * n - wo;
+      sample = {wi, float3(reflectance / cosI), reflectance, true};
+      return true;
+    }
+    const float cosT =
+        std::sqrt(std::max(0.0f, 1.0f - (1.0f - cosI * cosI) / (eta * eta)));
+    const float3 wi = -wo / eta + (cosI / eta - cosT) * n;
+    const float transmittance = 1.0f - reflectance;
+    sample = {normalize(wi), m_tint * (transmittance / cosT), transmittance,
+              true};
+    return true;
+  }
+  virtual float3 eval(const HitInfo &info, const float3 &wo,
+                      const float3 &wi) const {
+    return float3(0.0f);
+  }
+  virtual float pdf(const HitInfo &info, const float3 &wo,
+                    const float3 &wi) const {
+    return 0.0f;
+  }
+  virtual float3 albedo(const HitInfo &info) const { return m_tint; }
+  virtual bool delta() const { return true; }
+
+private:
+  float m_eta;
+  float3 m_tint;
+};
+
+// Invisible boundary of a medium. Rays cross it unchanged and change the
+// medium they travel in.
+class MediumBoundary : public Material {
+public:
+  MediumBoundary(const Medium *inside, const Medium *outside = nullptr)
+      : m_inside(inside), m_outside(outside) {}
+  virtual bool sample(const HitInfo &info, const float3 &wo, const float2 &u,
+                      BsdfSample &sample) const {
+    sample = {-wo, float3(1.0f / std::abs(dot(wo, info.normal))), 1.0f, true};
+    return true;
+  }
+  virtual float3 eval(const HitInfo &info, const float3 &wo,
+                      const float3 &wi) const {
+    return float3(0.0f);
+  }
+  virtual float pdf(const HitInfo &info, const float3 &wo,
+                    const float3 &wi) const {
+    return 0.0f;
+  }
+  virtual float3 albedo(const HitInfo &info) const { return float3(1.0f); }
+  virtual bool delta() const { return true; }
+  virtual bool boundary() const { return true; }
+  virtual const Medium *inside() const { return m_inside; }
+  virtual const Medium *outside() const { return m_outside; }
+
+private:
+  const Medium *m_inside;
+  const Medium *m_outside;
+};
+
+// Black body emitting a constant radiance; spheres with it are lights.
+class DiffuseLight : public Material {
+public:
+  DiffuseLight(const float3 &radiance) : m_radiance(radiance) {}
+  virtual bool sample(const HitInfo &info, const float3 &wo, const float2 &u,
+                      BsdfSample &sample) const {
+    return false;
+  }
+  virtual float3 eval(const HitInfo &info, const float3 &wo,
+                      const float3 &wi) const {
+    return float3(0.0f);
+  }
+  virtual float pdf(const HitInfo &info, const float3 &wo,
+                    const float3 &wi) const {
+    return 0.0f;
+  }
+  virtual float3 albedo(const HitInfo &info) const { return m_radiance; }
+  virtual float3 emission() const { return m_radiance; }
+
+private:
+  float3 m_radiance;
 };
 
 class Camera {
 public:
+  // aperture is the diameter of the lens, 0 for a pinhole, and focusDist
+  // the distance of the plane in focus. With 3 or more blades the lens is a
+  // regular polygon rather than round, which shapes the out of focus
+  // highlights.
   Camera(float3 eye, float3 at, float3 up, float fov, float aspect,
-         float aperture, float focusDist) {
+         float aperture, float focusDist, int blades = 0) {
     m_lensRadius = aperture / 2.0f;
+    m_blades = blades;
 
     const double pi = 3.14159265358979323846;
 
     const float theta = fov * static_cast<float>(pi) / 180.0f;
     const float half_height = tanf(theta / 2.0f);
     const float half_width = aspect * half_height;
+    m_halfHeight = half_height;
 
     m_origin = eye;
 
@@ -151,12 +1044,23 @@ public:
     m_horizontal = 2.0f * half_width * focusDist * m_u;
     m_vertical = 2.0f * half_height * focusDist * m_v;
   }
-  Ray generate(float s, float t) {
-    float3 rd = m_lensRadius * iq::randomInUnitDisk();
-    float3 offset = m_u * rd.x + m_v * rd.y;
-    return Ray(m_origin + offset,
-               normalize(m_lowerLeftCorner + s * m_horizontal + t * m_vertical -
-                         m_origin - offset));
+  Ray generate(float s, float t) const {
+    const float3 target =
+        m_lowerLeftCorner + s * m_horizontal + t * m_vertical;
+    if (m_lensRadius == 0.0f) {
+      // Pinhole, no lens sample needed.
+      return Ray(m_origin, normalize(target - m_origin));
+    }
+    const float2 u(iq::random(), iq::random());
+    const float2 lens = m_lensRadius * (m_blades > 2
+                                            ? iq::samplePolygon(u, m_blades)
+                                            : iq::sampleConcentricDisk(u));
+    const float3 offset = m_u * lens.x + m_v * lens.y;
+    return Ray(m_origin + offset, normalize(target - m_origin - offset));
+  }
+  // Angle subtended by one pixel row, the spread of primary ray cones.
+  float pixelSpread(size_t height) const {
+    return 2.0f * m_halfHeight / float(height);
   }
 
 private:
@@ -166,130 +1070,3422 @@ private:
   float3 m_vertical;
   float3 m_u, m_v, m_w;
   float m_lensRadius;
+  int m_blades;
+  float m_halfHeight;
 };
 
-class World {
+namespace iq {
+// Bump allocator for scene objects. Objects are carved out of large blocks,
+// never freed one by one, and destroyed together with the arena in reverse
+// order of creation.
+class Arena {
 public:
-  std::optional<HitInfo> intersect(const Ray &ray, const float tmin,
-                                   const float tmax) const {
-    std::optional<HitInfo> nearest;
-    float closest = tmax;
-    for (size_t i = 0; i < m_spheres.size(); ++i) {
-      const Sphere *sphere = m_spheres[i].get();
-      if (auto local = sphere->intersect(ray, tmin, closest)) {
-        closest = local->t;
-        nearest = local;
-      }
+  explicit Arena(size_t blockSize = 64 * 1024) : m_blockSize(blockSize) {}
+  Arena(Arena &&other) noexcept
+      : m_blockSize(other.m_blockSize), m_blocks(std::move(other.m_blocks)),
+        m_next(other.m_next), m_end(other.m_end),
+        m_destructors(std::move(other.m_destructors)) {
+    other.m_blocks.clear();
+    other.m_next = other.m_end = nullptr;
+    other.m_destructors.clear();
+  }
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  ~Arena() {
+    for (auto it = m_destructors.rbegin(); it != m_destructors.rend(); ++it) {
+      it->destroy(it->object);
     }
+  }
 
-    return nearest;
+  void *allocate(size_t size, size_t alignment) {
+    size_t space = size_t(m_end - m_next);
+    void *p = m_next;
+    if (m_next == nullptr || !std::align(alignment, size, p, space)) {
+      const size_t block = std::max(m_blockSize, size + alignment);
+      m_blocks.push_back(std::make_unique<char[]>(block));
+      m_next = m_blocks.back().get();
+      m_end = m_next + block;
+      space = block;
+      p = m_next;
+      std::align(alignment, size, p, space);
+    }
+    m_next = static_cast<char *>(p) + size;
+    return p;
   }
-  void add(shared_ptr<Sphere> sphere) {
-    m_spheres.push_back(std::move(sphere));
+
+  template <typename T, typename... Args> T *create(Args &&... args) {
+    T *object = new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      m_destructors.push_back(
+          {object, [](void *p) { static_cast<T *>(p)->~T(); }});
+    }
+    return object;
   }
 
 private:
-  std::vector<shared_ptr<Sphere>> m_spheres;
+  struct Destructor {
+    void *object;
+    void (*destroy)(void *);
+  };
+
+  size_t m_blockSize;
+  vector<std::unique_ptr<char[]>> m_blocks;
+  char *m_next = nullptr;
+  char *m_end = nullptr;
+  vector<Destructor> m_destructors;
 };
+} // namespace iq
 
-float3 radiance(const Ray &ray, const World &world, int depth) {
-  const float tmin = numeric_limits<float>::min();
-  const float tmax = numeric_limits<float>::max();
-  const int maxDepth = 16;
-
-  if (auto info = world.intersect(ray, tmin, tmax)) {
-    Ray scattered;
-    float3 attenuation;
-    if (depth < maxDepth &&
-        info->material->scatter(ray, *info, attenuation, scattered)) {
-      return attenuation * radiance(scattered, world, depth + 1);
-    } else {
-      return float3(0.0f, 0.0f, 0.0f);
+namespace iq {
+// Walker's alias method with Vose's construction: draws from a discrete
+// distribution in constant time with one table lookup.
+class AliasTable {
+public:
+  AliasTable() {}
+  explicit AliasTable(const vector<float> &weights) : m_bins(weights.size()) {
+    const double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+    if (total <= 0.0) {
+      m_bins.clear();
+      return;
+    }
+    const size_t n = weights.size();
+    vector<double> scaled(n);
+    vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; ++i) {
+      m_bins[i].pdf = float(weights[i] / total);
+      scaled[i] = weights[i] / total * double(n);
+      (scaled[i] < 1.0 ? small : large).push_back(uint32_t(i));
+    }
+    while (!small.empty() && !large.empty()) {
+      const uint32_t s = small.back(), l = large.back();
+      small.pop_back();
+      m_bins[s].threshold = float(scaled[s]);
+      m_bins[s].alias = l;
+      scaled[l] -= 1.0 - scaled[s];
+      if (scaled[l] < 1.0) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // Leftovers are 1 up to rounding.
+    for (uint32_t i : small) {
+      m_bins[i].threshold = 1.0f;
+    }
+    for (uint32_t i : large) {
+      m_bins[i].threshold = 1.0f;
     }
-  } else {
-    float3 unitDirection = normalize(ray.dir);
-    float t = 0.5f * (unitDirection.y + 1.0f);
-    return float3(1.0f - t) * float3(1.0f, 1.0f, 1.0f) +
-           float3(t) * float3(0.1f, 0.1f, 0.1f);
   }
-}
-
-int main(int argc, char **argv) {
-  const size_t width = 800;
-  const size_t height = 600;
-  const size_t samples = 8;
 
-  vector<byte3> pixels(width * height);
-  vector<double3> accumulation(width * height);
+  bool empty() const { return m_bins.empty(); }
+  float pdf(size_t index) const { return m_bins[index].pdf; }
 
-  const float3 eye(0.0f, 2.0f, 3.0f);
-  const float3 at(0.0f, 0.0f, 0.0f);
-  const float3 up(0.0f, -1.0f, 0.0f);
+  // Picks an index from u in [0, 1) and remaps u to a fresh uniform.
+  size_t sample(float &u) const {
+    const float scaled = u * float(m_bins.size());
+    const size_t bin = std::min(size_t(scaled), m_bins.size() - 1);
+    const Bin &b = m_bins[bin];
+    const float f = std::min(scaled - float(bin), 0x1.fffffep-1f);
+    if (f < b.threshold) {
+      u = f / b.threshold;
+      return bin;
+    }
+    u = std::min((f - b.threshold) / (1.0f - b.threshold), 0x1.fffffep-1f);
+    return b.alias;
+  }
 
-  const float focusDist = 3.0f;
-  const float aperture = 0.0f;
-  const float aspect = float(width) / float(height);
-  const float fov = 40.0f;
+private:
+  struct Bin {
+    float threshold = 1.0f;
+    uint32_t alias = 0;
+    float pdf = 0.0f;
+  };
+  vector<Bin> m_bins;
+};
+} // namespace iq
 
-  Camera camera(eye, at, up, fov, aspect, aperture, focusDist);
-
-  vector<shared_ptr<Material>> materials;
-  materials.push_back(make_shared<Lambertian>(float3(0.75f, 0.75f, 0.75f)));
-  materials.push_back(make_shared<Lambertian>(float3(0.8f, 0.8f, 0.9f)));
-  materials.push_back(make_shared<Lambertian>(float3(0.0f, 1.0f, 0.0f)));
-  materials.push_back(make_shared<Lambertian>(float3(1.0f, 0.0f, 0.0f)));
-  materials.push_back(make_shared<Lambertian>(float3(1.0f, 1.0f, 1.0f)));
-
-  vector<shared_ptr<Sphere>> spheres;
-  spheres.push_back(
-      make_shared<Sphere>(float3(0.0f, -100.5f, -1.0f), 100.0f, materials[0]));
-  spheres.push_back(
-      make_shared<Sphere>(float3(1.0f, 0.0f, -1.0f), 0.5f, materials[1]));
-  spheres.push_back(
-      make_shared<Sphere>(float3(0.0f, 0.0f, -1.0f), 0.5f, materials[2]));
-  spheres.push_back(
-      make_shared<Sphere>(float3(-1.0f, 0.0f, -1.0f), 0.5f, materials[3]));
-  spheres.push_back(
-      make_shared<Sphere>(float3(0.0f, 0.0f, 0.0f), 0.5f, materials[4]));
+namespace iq {
+// Bounding volume hierarchy over the emissive spheres that picks one light
+// per shading point in O(log n), after Conty Estevez and Kulla, "Importance
+// Sampling of Many Lights with Adaptive Tree Splitting" (2018). Each node
+// bounds its lights and sums their power; sampling descends into a child in
+// proportion to its power over squared distance, times the cosine of the
+// smallest angle between the shading normal and the child's bounds. Sphere
+// lights emit in every direction, so nodes need no emitter normal cone.
+class LightTree {
+public:
+  struct Light {
+    float3 center;
+    float radius;
+    float power;
+    uint32_t primitive;
+  };
 
-  World world;
-  for (const auto sphere : spheres) {
-    world.add(sphere);
+  LightTree() {}
+  explicit LightTree(vector<Light> lights)
+      : m_lights(std::move(lights)), m_trails(m_lights.size()) {
+    if (m_lights.empty()) {
+      return;
+    }
+    vector<uint32_t> order(m_lights.size());
+    std::iota(order.begin(), order.end(), 0);
+    m_nodes.reserve(2 * m_lights.size() - 1);
+    build(order.data(), order.data() + order.size(), 0, 0);
   }
 
-  auto start = chrono::steady_clock::now();
-
-  for (size_t s = 1; s < samples + 1; ++s) {
-    for (int y = 0; y < height; y++) {
-      for (int x = 0; x < width; x++) {
-        const float u = float(x + iq::random()) / float(width);
-        const float v = float(y + iq::random()) / float(height);
+  bool empty() const { return m_nodes.empty(); }
+  const Light &light(uint32_t index) const { return m_lights[index]; }
 
-        const Ray ray = camera.generate(u, v);
-        const float3 rgb = radiance(ray, world, 0);
+  // Picks a light for point p lit from the side n faces, or from all
+  // directions for n = 0, with probability pmf.
+  bool sample(const float3 &p, const float3 &n, float u, uint32_t &index,
+              float &pmf) const {
+    if (m_nodes.empty()) {
+      return false;
+    }
+    uint32_t node = 0;
+    pmf = 1.0f;
+    while (m_nodes[node].light == interior) {
+      const float left = importance(p, n, m_nodes[node + 1]);
+      const float right = importance(p, n, m_nodes[m_nodes[node].second]);
+      if (left + right <= 0.0f) {
+        return false;
+      }
+      const float pLeft = left / (left + right);
+      if (u < pLeft) {
+        u = std::min(u / pLeft, 0x1.fffffep-1f);
+        pmf *= pLeft;
+        node = node + 1;
+      } else {
+        u = std::min((u - pLeft) / (1.0f - pLeft), 0x1.fffffep-1f);
+        pmf *= 1.0f - pLeft;
+        node = m_nodes[node].second;
+      }
+    }
+    index = m_nodes[node].light;
+    return true;
+  }
 
-        const float3 color = float3(sqrt(rgb[0]), sqrt(rgb[1]), sqrt(rgb[2]));
-        accumulation[x + y * width] += double3(color);
+  // Probability that sample() picks light index at p, following the
+  // branches recorded for it while building.
+  float pmf(const float3 &p, const float3 &n, uint32_t index) const {
+    uint64_t trail = m_trails[index];
+    uint32_t node = 0;
+    float pmf = 1.0f;
+    while (m_nodes[node].light == interior) {
+      const float left = importance(p, n, m_nodes[node + 1]);
+      const float right = importance(p, n, m_nodes[m_nodes[node].second]);
+      if (left + right <= 0.0f) {
+        return 0.0f;
+      }
+      if (trail & 1) {
+        pmf *= right / (left + right);
+        node = m_nodes[node].second;
+      } else {
+        pmf *= left / (left + right);
+        node = node + 1;
       }
+      trail >>= 1;
     }
+    return pmf;
+  }
+
+private:
+  static constexpr uint32_t interior = ~uint32_t(0);
 
-    for (size_t i = 0; i < accumulation.size(); ++i) {
-      const double3 value = accumulation[i];
-      const double3 color = value * double3(1.0f / s);
+  struct Node {
+    float3 lo, hi;
+    float power;
+    uint32_t second; // right child, the left one follows its parent
+    uint32_t light;  // interior for inner nodes
+  };
 
-      pixels[i] =
-          byte3(255.0f * color[0], 255.0f * color[1], 255.0f * color[2]);
+  // Depth first, splitting at the median center along the longest axis,
+  // which bounds the depth by log2(n) and so the trails by 64 bits.
+  uint32_t build(uint32_t *first, uint32_t *last, int depth,
+                 uint64_t trail) {
+    const uint32_t index = uint32_t(m_nodes.size());
+    m_nodes.emplace_back();
+    const float inf = numeric_limits<float>::infinity();
+    Node node{float3(inf), float3(-inf), 0.0f, 0, interior};
+    float3 lo(inf), hi(-inf);
+    for (const uint32_t *i = first; i != last; ++i) {
+      const Light &light = m_lights[*i];
+      node.lo = linalg::min(node.lo, light.center - float3(light.radius));
+      node.hi = linalg::max(node.hi, light.center + float3(light.radius));
+      node.power += light.power;
+      lo = linalg::min(lo, light.center);
+      hi = linalg::max(hi, light.center);
+    }
+    if (last - first == 1) {
+      node.light = *first;
+      m_trails[*first] = trail;
+    } else {
+      const float3 extent = hi - lo;
+      const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2)
+                                           : (extent.y > extent.z ? 1 : 2);
+      uint32_t *middle = first + (last - first) / 2;
+      std::nth_element(first, middle, last, [&](uint32_t a, uint32_t b) {
+        return m_lights[a].center[axis] < m_lights[b].center[axis];
+      });
+      build(first, middle, depth + 1, trail);
+      node.second =
+          build(middle, last, depth + 1, trail | uint64_t(1) << depth);
     }
+    m_nodes[index] = node;
+    return index;
+  }
 
-    stbi_write_png("iq.png", width, height, 3, pixels.data(), width * 3);
+  static float importance(const float3 &p, const float3 &n, const Node &node) {
+    const float3 d = 0.5f * (node.lo + node.hi) - p;
+    const float d2 = dot(d, d);
+    const float r2 = 0.25f * dot(node.hi - node.lo, node.hi - node.lo);
+    if (n.x == 0.0f && n.y == 0.0f && n.z == 0.0f) {
+      return node.power / std::max(d2, 0.25f * r2); // in a medium
+    }
+    if (d2 <= r2) {
+      // Inside the bounds any direction may hold a light; the distance is
+      // clamped to half the bounds' radius.
+      return node.power / std::max(d2, 0.25f * r2);
+    }
+    // cos(max(theta - thetaU, 0)), thetaU the half angle of the bounding
+    // sphere seen from p.
+    const float cosTheta = dot(n, d) / std::sqrt(d2);
+    const float sin2U = r2 / d2;
+    const float cosU = std::sqrt(1.0f - sin2U);
+    float cosBound = 1.0f;
+    if (cosTheta < cosU) {
+      const float sinTheta =
+          std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+      cosBound = cosTheta * cosU + sinTheta * std::sqrt(sin2U);
+    }
+    return cosBound > 0.0f ? node.power * cosBound / d2 : 0.0f;
   }
 
-  auto end = chrono::steady_clock::now();
-  auto diff = end - start;
+  vector<Light> m_lights;
+  vector<uint64_t> m_trails; // branches taken to each light, root first
+  vector<Node> m_nodes;
+};
+} // namespace iq
 
-  std::cout << "Elapsed "
-            << chrono::duration_cast<chrono::milliseconds>(diff).count()
-            << " [ms]" << std::endl;
+namespace iq {
+// Bounding volume hierarchy over moving primitives. Every node keeps its
+// box at the start and at the end of the shutter interval; for linear
+// motion the boxes in between are bounded by interpolating the two, so a
+// ray at time t is tested against the box at t rather than one swept over
+// the whole interval. Built by median splits along the longest axis of the
+// centroids at mid-shutter, with up to eight primitives per leaf.
+class Bvh {
+public:
+  struct Box {
+    float3 lo[2], hi[2]; // at time 0 and 1
+  };
 
-  return 0;
-}
\ No newline at end of file
+  Bvh() {}
+  explicit Bvh(const vector<Box> &boxes) : m_indices(boxes.size()) {
+    std::iota(m_indices.begin(), m_indices.end(), 0u);
+    if (!boxes.empty()) {
+      m_nodes.reserve(2 * boxes.size());
+      build(boxes, 0, uint32_t(boxes.size()));
+    }
+  }
+
+  // Calls visit(index) for the primitives in the nodes the ray enters
+  // before tmax, nearest node first, until it returns true. visit may lower
+  // tmax.
+  template <typename Visit>
+  void traverse(const Ray &ray, const float &tmax, const Visit &visit) const {
+    if (m_nodes.empty()) {
+      return;
+    }
+    const float3 inverse = 1.0f / ray.dir;
+    uint32_t stack[64];
+    size_t size = 0;
+    uint32_t node = 0;
+    for (;;) {
+      const Node &n = m_nodes[node];
+      if (n.count > 0) {
+        for (uint32_t i = n.offset; i < n.offset + n.count; ++i) {
+          if (visit(m_indices[i])) {
+            return;
+          }
+        }
+      } else {
+        float near0, near1;
+        const bool hit0 = enter(m_nodes[node + 1], ray, inverse, tmax, near0);
+        const bool hit1 = enter(m_nodes[n.offset], ray, inverse, tmax, near1);
+        if (hit0 && hit1) {
+          const bool swap = near1 < near0;
+          stack[size++] = swap ? node + 1 : n.offset;
+          node = swap ? n.offset : node + 1;
+          continue;
+        }
+        if (hit0 || hit1) {
+          node = hit0 ? node + 1 : n.offset;
+          continue;
+        }
+      }
+      if (size == 0) {
+        return;
+      }
+      node = stack[--size];
+    }
+  }
+
+private:
+  // Leaves hold count primitives from offset, inner nodes have count 0 and
+  // their second child at offset; the first follows them.
+  struct Node {
+    Box box;
+    uint32_t offset;
+    uint32_t count;
+  };
+
+  static bool enter(const Node &node, const Ray &ray, const float3 &inverse,
+                    float tmax, float &near) {
+    const float t = ray.time;
+    const float3 lo = node.box.lo[0] + (node.box.lo[1] - node.box.lo[0]) * t;
+    const float3 hi = node.box.hi[0] + (node.box.hi[1] - node.box.hi[0]) * t;
+    const float3 t0 = (lo - ray.org) * inverse;
+    const float3 t1 = (hi - ray.org) * inverse;
+    near = std::max(maxelem(linalg::min(t0, t1)), 0.0f);
+    const float far = std::min(minelem(linalg::max(t0, t1)), tmax);
+    // Rounding up far keeps rays grazing a box from missing it.
+    return near <= far * (1.0f + 2.0f * gamma(3));
+  }
+
+  uint32_t build(const vector<Box> &boxes, uint32_t begin, uint32_t end) {
+    const uint32_t index = uint32_t(m_nodes.size());
+    m_nodes.emplace_back();
+    Box box = boxes[m_indices[begin]];
+    float3 lo(numeric_limits<float>::max()), hi(-lo);
+    for (uint32_t i = begin; i < end; ++i) {
+      const Box &b = boxes[m_indices[i]];
+      for (int k = 0; k < 2; ++k) {
+        box.lo[k] = linalg::min(box.lo[k], b.lo[k]);
+        box.hi[k] = linalg::max(box.hi[k], b.hi[k]);
+      }
+      const float3 centroid = 0.25f * (b.lo[0] + b.hi[0] + b.lo[1] + b.hi[1]);
+      lo = linalg::min(lo, centroid);
+      hi = linalg::max(hi, centroid);
+    }
+    m_nodes[index].box = box;
+    const float3 extent = hi - lo;
+    const int axis = argmax(extent);
+    if (end - begin <= 8 || extent[axis] <= 0.0f) {
+      m_nodes[index].offset = begin;
+      m_nodes[index].count = end - begin;
+      return index;
+    }
+    const uint32_t middle = begin + (end - begin) / 2;
+    std::nth_element(m_indices.begin() + begin, m_indices.begin() + middle,
+                     m_indices.begin() + end, [&](uint32_t a, uint32_t b) {
+                       const Box &x = boxes[a], &y = boxes[b];
+                       return x.lo[0][axis] + x.hi[0][axis] + x.lo[1][axis] +
+                                  x.hi[1][axis] <
+                              y.lo[0][axis] + y.hi[0][axis] + y.lo[1][axis] +
+                                  y.hi[1][axis];
+                     });
+    build(boxes, begin, middle);
+    const uint32_t second = build(boxes, middle, end);
+    m_nodes[index].offset = second;
+    m_nodes[index].count = 0;
+    return index;
+  }
+
+  vector<uint32_t> m_indices;
+  vector<Node> m_nodes;
+};
+} // namespace iq
+
+// Radiance from infinitely far away as an equirectangular image, the top
+// row looking up along +y.
+// Directions are importance sampled per texel by luminance times solid
+// angle; lookups are nearest texel so sampling follows them exactly.
+class Environment {
+public:
+  explicit Environment(const iq::texture::Source &source)
+      : m_width(source.width()), m_height(source.height()),
+        m_texels(m_width * m_height) {
+    source.read(0, 0, m_width, m_height, m_texels.data());
+    vector<float> weights(m_texels.size());
+    for (size_t y = 0; y < m_height; ++y) {
+      const float sinTheta = std::sin(iq::pi * (y + 0.5f) / m_height);
+      for (size_t x = 0; x < m_width; ++x) {
+        const float luminance = iq::luminance(m_texels[x + y * m_width]);
+        weights[x + y * m_width] = std::max(luminance, 0.0f) * sinTheta;
+      }
+    }
+    m_distribution = iq::AliasTable(weights);
+    m_power = std::accumulate(weights.begin(), weights.end(), 0.0f) * 2.0f *
+              iq::pi * iq::pi / float(m_width * m_height);
+  }
+
+  // The former background, grey above and white below. It only varies with
+  // y, so a single column is enough.
+  static iq::texture::Procedural gradient() {
+    return iq::texture::Procedural(1, 1024, [](float u, float v) {
+      const float t = 0.5f * (direction(u, v).y + 1.0f);
+      return float3(1.0f - t) + float3(t) * float3(0.1f);
+    });
+  }
+
+  float3 eval(const float3 &dir) const { return m_texels[texel(dir)]; }
+
+  // Direction towards the environment with its radiance and solid angle
+  // density; false if the environment is black.
+  bool sample(float2 u, float3 &dir, float3 &value, float &pdf) const {
+    if (m_distribution.empty()) {
+      return false;
+    }
+    const size_t index = m_distribution.sample(u.x);
+    const size_t x = index % m_width, y = index / m_width;
+    const float v = (float(y) + u.y) / float(m_height);
+    dir = direction((float(x) + u.x) / float(m_width), v);
+    const float sinTheta = std::sin(iq::pi * v);
+    if (sinTheta <= 0.0f) {
+      return false;
+    }
+    value = m_texels[index];
+    pdf = density(index, sinTheta);
+    return true;
+  }
+
+  // Luminance integrated over all directions.
+  float power() const { return m_power; }
+
+  float pdf(const float3 &dir) const {
+    if (m_distribution.empty()) {
+      return 0.0f;
+    }
+    const float sinTheta = std::sqrt(std::max(1.0f - dir.y * dir.y, 0.0f));
+    return sinTheta > 0.0f ? density(texel(dir), sinTheta) : 0.0f;
+  }
+
+private:
+  static float3 direction(float u, float v) {
+    const float phi = 2.0f * iq::pi * u - iq::pi, theta = iq::pi * v;
+    return float3(std::sin(theta) * std::cos(phi), std::cos(theta),
+                  std::sin(theta) * std::sin(phi));
+  }
+
+  size_t texel(const float3 &dir) const {
+    const float u = (std::atan2(dir.z, dir.x) + iq::pi) / (2.0f * iq::pi);
+    const float v = std::acos(std::clamp(dir.y, -1.0f, 1.0f)) / iq::pi;
+    const size_t x = std::min(size_t(u * m_width), m_width - 1);
+    const size_t y = std::min(size_t(v * m_height), m_height - 1);
+    return x + y * m_width;
+  }
+
+  // Texel probability over its (u, v) area, mapped to solid angle.
+  float density(size_t index, float sinTheta) const {
+    return m_distribution.pdf(index) * float(m_width * m_height) /
+           (2.0f * iq::pi * iq::pi * sinTheta);
+  }
+
+  size_t m_width, m_height;
+  vector<float3> m_texels;
+  iq::AliasTable m_distribution;
+  float m_power;
+};
+
+// Scene store. Spheres live by value in one contiguous array and are
+// addressed by stable indices; materials are allocated from the world's
+// arena and released with it in one go.
+class World {
+public:
+  std::optional<HitInfo> intersect(const Ray &ray, const float tmin,
+                                   const float tmax) const {
+    const Sphere *nearest = nullptr;
+    float closest = tmax;
+    m_bvh.traverse(ray, closest, [&](uint32_t i) {
+      if (m_spheres[i].intersect(ray, tmin, closest, closest)) {
+        nearest = &m_spheres[i];
+      }
+      return false;
+    });
+
+    if constexpr (iq::stats::enabled) {
+      ++(nearest != nullptr ? iq::stats::local().hits
+                            : iq::stats::local().misses);
+    }
+    if (nearest == nullptr) {
+      return {};
+    }
+    HitInfo info = nearest->interaction(ray, closest);
+    info.primitive = uint32_t(nearest - m_spheres.data());
+    return info;
+  }
+
+  // Any hit before tmax, for shadow rays.
+  bool occluded(const Ray &ray, const float tmin, const float tmax) const {
+    bool hit = false;
+    m_bvh.traverse(ray, tmax, [&](uint32_t i) {
+      float t;
+      hit = m_spheres[i].intersect(ray, tmin, tmax, t);
+      return hit;
+    });
+    return hit;
+  }
+
+  // Fraction of light getting through along a shadow ray before tmax, 0 or
+  // 1 unless it passes through media, which it estimates by ratio tracking
+  // across every medium boundary on the way.
+  float transmittance(Ray ray, float tmax) const {
+    const float tmin = numeric_limits<float>::min();
+    if (!m_hasMedia) {
+      return occluded(ray, tmin, tmax) ? 0.0f : 1.0f;
+    }
+    float transmittance = 1.0f;
+    for (;;) {
+      const auto hit = intersect(ray, tmin, tmax);
+      if (ray.medium != nullptr) {
+        transmittance *= ray.medium->transmittance(ray, hit ? hit->t : tmax);
+      }
+      if (!hit || transmittance <= 0.0f) {
+        return transmittance;
+      }
+      if (!hit->material->boundary()) {
+        return 0.0f;
+      }
+      const Medium *medium = dot(ray.dir, hit->normal) < 0.0f
+                                 ? hit->material->inside()
+                                 : hit->material->outside();
+      ray = hit->spawn(ray.dir, 0.0f);
+      ray.medium = medium;
+      tmax -= hit->t;
+    }
+  }
+
+  template <typename T, typename... Args> T *create(Args &&... args) {
+    return m_arena.create<T>(std::forward<Args>(args)...);
+  }
+  void reserve(size_t spheres) { m_spheres.reserve(spheres); }
+  // Returns the index of the new sphere.
+  uint32_t add(const Sphere &sphere) {
+    m_hasMedia = m_hasMedia || sphere.m_material->boundary();
+    m_spheres.push_back(sphere);
+    return uint32_t(m_spheres.size() - 1);
+  }
+  const Sphere &sphere(uint32_t index) const { return m_spheres[index]; }
+  size_t size() const { return m_spheres.size(); }
+  void setEnvironment(const Environment *environment) {
+    m_environment = environment;
+  }
+  const Environment &environment() const { return *m_environment; }
+
+  // Builds the BVH over the spheres, and collects the ones with emissive
+  // materials into the light tree and the photon emission table; call once
+  // all spheres are added.
+  void build() {
+    vector<iq::Bvh::Box> boxes(m_spheres.size());
+    vector<iq::LightTree::Light> lights;
+    vector<float> flux;
+    float3 lo(numeric_limits<float>::max()), hi(-lo);
+    m_lightIndex.assign(m_spheres.size(), noLight);
+    for (uint32_t i = 0; i < m_spheres.size(); ++i) {
+      const Sphere &sphere = m_spheres[i];
+      iq::Bvh::Box &box = boxes[i];
+      box.lo[0] = sphere.m_pos - sphere.m_radius;
+      box.hi[0] = sphere.m_pos + sphere.m_radius;
+      box.lo[1] = sphere.m_pos1 - sphere.m_radius;
+      box.hi[1] = sphere.m_pos1 + sphere.m_radius;
+      lo = linalg::min(lo, linalg::min(box.lo[0], box.lo[1]));
+      hi = linalg::max(hi, linalg::max(box.hi[0], box.hi[1]));
+      const float power = iq::luminance(sphere.m_material->emission()) *
+                          sphere.m_radius * sphere.m_radius;
+      if (power > 0.0f) {
+        // Moving lights are bounded over the whole interval.
+        const float3 travel = 0.5f * (sphere.m_pos1 - sphere.m_pos);
+        m_lightIndex[i] = uint32_t(lights.size());
+        lights.push_back({sphere.m_pos + travel,
+                          sphere.m_radius + length(travel), power, i});
+        flux.push_back(4.0f * iq::pi * iq::pi * power);
+      }
+    }
+    m_bvh = iq::Bvh(boxes);
+    m_lights = iq::LightTree(std::move(lights));
+    m_lightFlux = std::accumulate(flux.begin(), flux.end(), 0.0f);
+    m_emitters = iq::AliasTable(flux);
+    m_center = 0.5f * (lo + hi);
+    m_radius = 0.5f * length(hi - lo);
+  }
+
+  // Chooses an emissive sphere for p, lit from the side n faces, and a
+  // direction wi towards it where the sphere is at time. pdf is per solid
+  // angle and distance is the one to the light's surface.
+  bool sampleLight(const float3 &p, const float3 &n, float time,
+                   const float3 &u, float3 &wi, float3 &radiance, float &pdf,
+                   float &distance) const {
+    uint32_t index;
+    float pmf;
+    if (!m_lights.sample(p, n, u.x, index, pmf)) {
+      return false;
+    }
+    const Sphere &sphere = m_spheres[m_lights.light(index).primitive];
+    const float3 axis = sphere.center(time) - p;
+    const float oneMinusCosMax = subtended(sphere, p, time);
+    if (oneMinusCosMax <= 0.0f) {
+      return false;
+    }
+    wi = iq::Frame(normalize(axis))
+             .toWorld(iq::sampleUniformCone(float2(u.y, u.z), oneMinusCosMax));
+    Ray ray(p, wi);
+    ray.time = time;
+    // Directions at the rim may graze past the sphere in float.
+    if (!sphere.intersect(ray, 0.0f, numeric_limits<float>::max(), distance)) {
+      distance = dot(axis, wi);
+    }
+    radiance = sphere.m_material->emission();
+    pdf = pmf / (2.0f * iq::pi * oneMinusCosMax);
+    return true;
+  }
+
+  // Density of sampleLight() choosing the direction towards primitive.
+  float lightPdf(const float3 &p, const float3 &n, float time,
+                 uint32_t primitive) const {
+    if (primitive >= m_lightIndex.size() ||
+        m_lightIndex[primitive] == noLight) {
+      return 0.0f;
+    }
+    const float oneMinusCosMax = subtended(m_spheres[primitive], p, time);
+    return oneMinusCosMax > 0.0f
+               ? m_lights.pmf(p, n, m_lightIndex[primitive]) /
+                     (2.0f * iq::pi * oneMinusCosMax)
+               : 0.0f;
+  }
+
+  // Starts a photon at an emitter chosen in proportion to its flux: from a
+  // uniform point on a light sphere in a cosine distributed direction, or
+  // from the environment through a disk covering the scene, at a random
+  // time. power is the flux divided by the density of the choice; false if
+  // nothing emits.
+  bool emitPhoton(Ray &ray, float3 &power) const {
+    const float environmentFlux =
+        iq::pi * m_radius * m_radius * m_environment->power();
+    const float total = environmentFlux + m_lightFlux;
+    if (!(total > 0.0f)) {
+      return false;
+    }
+    float u = iq::random();
+    const float2 v(iq::random(), iq::random());
+    const float2 w(iq::random(), iq::random());
+    if (u * total < environmentFlux || !(m_lightFlux > 0.0f)) {
+      float3 dir, value;
+      float pdf;
+      if (!m_environment->sample(v, dir, value, pdf)) {
+        return false;
+      }
+      // Cosine sampled directions project to uniform points on the disk.
+      const float2 disk = iq::sampleCosineHemisphere(w).xy() * m_radius;
+      ray = Ray(m_center + iq::Frame(dir).toWorld(float3(disk, m_radius)),
+                -dir);
+      ray.time = iq::random();
+      power = value * (total / environmentFlux) *
+              (iq::pi * m_radius * m_radius / pdf);
+      return true;
+    }
+    // The lights' share of [0, 1) stretched back to all of it.
+    u = std::max(0.0f, (u * total - environmentFlux) / m_lightFlux);
+    const size_t index = m_emitters.sample(u);
+    const Sphere &sphere = m_spheres[m_lights.light(index).primitive];
+    const float z = 1.0f - 2.0f * v.x, phi = 2.0f * iq::pi * v.y;
+    const float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    const float3 n(r * std::cos(phi), r * std::sin(phi), z);
+    // Started just off the surface so that it cannot hit the light itself.
+    const float time = iq::random();
+    ray = Ray(sphere.center(time) + (1.0f + 1e-4f) * sphere.m_radius * n,
+              iq::Frame(n).toWorld(iq::sampleCosineHemisphere(w)));
+    ray.time = time;
+    const float area = 4.0f * iq::pi * sphere.m_radius * sphere.m_radius;
+    power = sphere.m_material->emission() *
+            (iq::pi * area * total / (m_lightFlux * m_emitters.pdf(index)));
+    return true;
+  }
+
+  // Copy with spheres and a BVH of its own, allocated by the calling thread
+  // and so placed on its NUMA node. Materials stay in this world's arena,
+  // which has to outlive the copy.
+  World clone() const {
+    World copy;
+    copy.m_spheres = m_spheres;
+    copy.m_bvh = m_bvh;
+    copy.m_environment = m_environment;
+    copy.m_hasMedia = m_hasMedia;
+    copy.m_lights = m_lights;
+    copy.m_lightIndex = m_lightIndex;
+    copy.m_emitters = m_emitters;
+    copy.m_lightFlux = m_lightFlux;
+    copy.m_center = m_center;
+    copy.m_radius = m_radius;
+    return copy;
+  }
+
+private:
+  static constexpr uint32_t noLight = ~uint32_t(0);
+
+  // 1 - cos of the half angle the sphere subtends from p at time, 0 from
+  // inside.
+  static float subtended(const Sphere &sphere, const float3 &p, float time) {
+    const float3 axis = sphere.center(time) - p;
+    const float d2 = dot(axis, axis);
+    const float sin2 = sphere.m_radius * sphere.m_radius / d2;
+    if (sin2 >= 1.0f) {
+      return 0.0f;
+    }
+    return sin2 / (1.0f + std::sqrt(1.0f - sin2));
+  }
+
+  iq::Arena m_arena;
+  vector<Sphere> m_spheres;
+  iq::Bvh m_bvh;
+  bool m_hasMedia = false;
+  const Environment *m_environment = nullptr;
+  iq::LightTree m_lights;
+  vector<uint32_t> m_lightIndex; // per sphere
+  // Photon emission: lights by flux and a bounding sphere of the scene.
+  iq::AliasTable m_emitters;
+  float m_lightFlux = 0.0f;
+  float3 m_center = float3(0.0f);
+  float m_radius = 0.0f;
+};
+
+// Arbitrary output variables recorded at the primary hit. IQ_AOVS is a mask
+// of iq::aov flags selecting the ones compiled in, 0 removes them entirely.
+#ifndef IQ_AOVS
+#define IQ_AOVS 0x1f
+#endif
+
+namespace iq {
+namespace aov {
+enum : unsigned {
+  Depth = 1 << 0,
+  Normal = 1 << 1,
+  Albedo = 1 << 2,
+  MaterialId = 1 << 3,
+  SampleCount = 1 << 4,
+};
+constexpr unsigned enabled = IQ_AOVS;
+} // namespace aov
+} // namespace iq
+
+struct PrimaryHit {
+  float t = 0.0f;
+  float3 normal = float3(0.0f);
+  float3 albedo = float3(0.0f);
+  uint32_t materialId = 0;
+};
+
+namespace iq {
+// Fixed size open addressing hash table over voxels of space, split by the
+// major axis of a surface normal so that the two sides of a surface get
+// voxels of their own. Slots are claimed by compare and swap and never
+// freed; a voxel that finds no free slot within a few probes is not stored,
+// which bounds memory. Users keep per-slot data in arrays of their own.
+class VoxelTable {
+public:
+  VoxelTable(size_t slots, float cellSize)
+      : m_inverseCell(1.0f / cellSize), m_mask(slots - 1), m_keys(slots) {}
+
+  size_t size() const { return m_keys.size(); }
+
+  // Slot of the voxel at p on the side n faces, or -1.
+  int find(const float3 &p, const float3 &n) const {
+    const uint64_t k = key(p, n);
+    const uint64_t h = hash(k);
+    for (int i = 0; i < maxProbes; ++i) {
+      const size_t slot = size_t(h + i) & m_mask;
+      const uint64_t found = m_keys[slot].load(std::memory_order_acquire);
+      if (found == k) {
+        return int(slot);
+      }
+      if (found == 0) {
+        return -1;
+      }
+    }
+    return -1;
+  }
+
+  // Like find(), but claims a slot for a new voxel. Thread safe.
+  int insert(const float3 &p, const float3 &n) {
+    const uint64_t k = key(p, n);
+    const uint64_t h = hash(k);
+    for (int i = 0; i < maxProbes; ++i) {
+      const size_t slot = size_t(h + i) & m_mask;
+      uint64_t found = m_keys[slot].load(std::memory_order_acquire);
+      if (found == 0 && m_keys[slot].compare_exchange_strong(
+                            found, k, std::memory_order_acq_rel)) {
+        return int(slot);
+      }
+      if (found == k) {
+        return int(slot);
+      }
+    }
+    return -1;
+  }
+
+private:
+  static constexpr int maxProbes = 8;
+
+  // Cell coordinates in 20 bits each, the normal's major axis and sign in
+  // 3 and a top bit that keeps keys nonzero, 0 marks a free slot.
+  uint64_t key(const float3 &p, const float3 &n) const {
+    const float3 a = abs(n);
+    const int axis = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+    const uint64_t side = uint64_t(2 * axis + (n[axis] < 0.0f));
+    uint64_t key = uint64_t(1) << 63 | side << 60;
+    for (int i = 0; i < 3; ++i) {
+      const int64_t c = int64_t(std::floor(p[i] * m_inverseCell));
+      key |= (uint64_t(c) & 0xfffff) << (20 * i);
+    }
+    return key;
+  }
+  static uint64_t hash(uint64_t key) {
+    const uint64_t h = key * 0x9e3779b97f4a7c15ull;
+    return h ^ h >> 32;
+  }
+
+  float m_inverseCell;
+  size_t m_mask;
+  vector<std::atomic<uint64_t>> m_keys;
+};
+
+inline void atomicAdd(std::atomic<float> &sum, float value) {
+  float old = sum.load(std::memory_order_relaxed);
+  while (!sum.compare_exchange_weak(old, old + value,
+                                    std::memory_order_relaxed)) {
+  }
+}
+
+// Online path guiding: a histogram of the radiance arriving from every
+// direction, learned per voxel during the first passes and sampled
+// together with the BSDF afterwards. Directions are binned over the sphere
+// by z and the azimuth, which gives bins of equal solid angle. Recording
+// adds to the bins atomically; the sampling distributions are rebuilt from
+// them between passes by update().
+class PathGuide {
+public:
+  static constexpr int zBins = 8, phiBins = 16, bins = zBins * phiBins;
+
+  PathGuide(size_t voxels, float cellSize)
+      : m_voxels(voxels, cellSize), m_counts(voxels), m_sums(voxels * bins),
+        m_cdf(voxels * bins), m_ready(voxels) {}
+
+  bool learning() const { return m_learning; }
+  void setLearning(bool learning) { m_learning = learning; }
+
+  // Voxel with a sampling distribution at p on the side n faces, or -1.
+  int find(const float3 &p, const float3 &n) const {
+    const int slot = m_voxels.find(p, n);
+    return slot >= 0 && m_ready[slot] ? slot : -1;
+  }
+
+  float3 sample(int voxel, float2 u) const {
+    const float *cdf = &m_cdf[size_t(voxel) * bins];
+    const int bin =
+        std::min(int(std::upper_bound(cdf, cdf + bins, u.x) - cdf), bins - 1);
+    const float lo = bin > 0 ? cdf[bin - 1] : 0.0f;
+    u.x = std::min((u.x - lo) / std::max(cdf[bin] - lo, 1e-20f),
+                   0x1.fffffep-1f);
+    const float z = -1.0f + 2.0f * (float(bin / phiBins) + u.y) / zBins;
+    const float phi = 2.0f * pi * (float(bin % phiBins) + u.x) / phiBins;
+    const float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    return float3(r * std::cos(phi), r * std::sin(phi), z);
+  }
+
+  // Solid angle density of sample().
+  float pdf(int voxel, const float3 &wi) const {
+    const float *cdf = &m_cdf[size_t(voxel) * bins];
+    const int b = bin(wi);
+    return (cdf[b] - (b > 0 ? cdf[b - 1] : 0.0f)) * bins / (4.0f * pi);
+  }
+
+  // Adds radiance arriving at p from wi, divided by the density it was
+  // sampled with. Thread safe.
+  void record(const float3 &p, const float3 &n, const float3 &wi,
+              float value) {
+    if (!(value > 0.0f) || std::isinf(value)) {
+      return;
+    }
+    const int slot = m_voxels.insert(p, n);
+    if (slot < 0) {
+      return;
+    }
+    atomicAdd(m_sums[size_t(slot) * bins + bin(wi)], value);
+    m_counts[slot].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Rebuilds the sampling distributions of the voxels with enough records
+  // from all records so far. Not thread safe; call between passes.
+  void update() {
+    for (size_t slot = 0; slot < m_voxels.size(); ++slot) {
+      if (m_counts[slot].load(std::memory_order_relaxed) < minRecords) {
+        continue;
+      }
+      float *cdf = &m_cdf[slot * bins];
+      float total = 0.0f;
+      for (int b = 0; b < bins; ++b) {
+        total += m_sums[slot * bins + b].load(std::memory_order_relaxed);
+        cdf[b] = total;
+      }
+      for (int b = 0; b < bins; ++b) {
+        cdf[b] /= total;
+      }
+      m_ready[slot] = total > 0.0f;
+    }
+  }
+
+private:
+  static constexpr uint32_t minRecords = 64;
+
+  static int bin(const float3 &w) {
+    const int z = std::clamp(int((w.z + 1.0f) * 0.5f * zBins), 0, zBins - 1);
+    const float phi = std::atan2(w.y, w.x);
+    const int p = int((phi < 0.0f ? phi + 2.0f * pi : phi) *
+                      (phiBins / (2.0f * pi)));
+    return z * phiBins + std::clamp(p, 0, phiBins - 1);
+  }
+
+  VoxelTable m_voxels;
+  bool m_learning = false;
+  vector<std::atomic<uint32_t>> m_counts;
+  vector<std::atomic<float>> m_sums;
+  vector<float> m_cdf;
+  vector<uint8_t> m_ready;
+};
+
+// Light reflected by diffuse surfaces over their albedo, averaged per voxel
+// over the paths through it. Records are added without locks; a lookup may
+// see a record's color before its count, which only adds to the noise.
+class RadianceCache {
+public:
+  RadianceCache(size_t voxels, float cellSize)
+      : m_voxels(voxels, cellSize), m_counts(voxels), m_sums(3 * voxels) {}
+
+  // Mean of the voxel at p on the side n faces, false until it has enough
+  // records.
+  bool lookup(const float3 &p, const float3 &n, float3 &value) const {
+    const int slot = m_voxels.find(p, n);
+    if (slot < 0) {
+      return false;
+    }
+    const uint32_t count = m_counts[slot].load(std::memory_order_relaxed);
+    if (count < minRecords) {
+      return false;
+    }
+    for (int i = 0; i < 3; ++i) {
+      value[i] = m_sums[3 * slot + i].load(std::memory_order_relaxed);
+    }
+    value /= float(count);
+    return true;
+  }
+
+  // Thread safe.
+  void record(const float3 &p, const float3 &n, const float3 &value) {
+    if (!std::isfinite(value.x + value.y + value.z)) {
+      return;
+    }
+    const int slot = m_voxels.insert(p, n);
+    if (slot < 0) {
+      return;
+    }
+    for (int i = 0; i < 3; ++i) {
+      atomicAdd(m_sums[3 * slot + i], value[i]);
+    }
+    m_counts[slot].fetch_add(1, std::memory_order_relaxed);
+  }
+
+private:
+  static constexpr uint32_t minRecords = 16;
+
+  VoxelTable m_voxels;
+  vector<std::atomic<uint32_t>> m_counts;
+  vector<std::atomic<float>> m_sums;
+};
+} // namespace iq
+
+// Power heuristic weight of a strategy with density a against one with b.
+inline float misWeight(float a, float b) { return a * a / (a * a + b * b); }
+
+// The surface a ray was scattered from by BSDF sampling, for weighting the
+// light it finds against light sampling at that surface.
+struct Bounce {
+  float3 p;
+  float3 normal; // facing the incoming ray, 0 in media
+  float pdf;
+};
+
+// One sample of the environment and one of the emissive spheres for a
+// scattering event at p and time, lit from the side n faces or from
+// everywhere for n = 0. spawn(wi) makes the shadow ray and scatter(wi, pdf)
+// returns the BSDF times cosine or phase function value and its sampling
+// density. Zero values, e.g. of specular lobes, skip the shadow ray.
+template <typename Spawn, typename Scatter>
+float3 directLight(const World &world, const float3 &p, const float3 &n,
+                   float time, const Spawn &spawn, const Scatter &scatter) {
+  float3 direct(0.0f);
+  const auto add = [&](const float3 &wi, const float3 &value, float lightPdf,
+                       float distance) {
+    float pdf;
+    const float3 f = scatter(wi, pdf);
+    if (f.x > 0.0f || f.y > 0.0f || f.z > 0.0f) {
+      const float transmittance = world.transmittance(spawn(wi), distance);
+      if (transmittance > 0.0f) {
+        direct += f * value *
+                  (transmittance * misWeight(lightPdf, pdf) / lightPdf);
+      }
+    }
+  };
+  float3 wi, value;
+  float lightPdf, distance;
+  const float2 ul(iq::random(), iq::random());
+  if (world.environment().sample(ul, wi, value, lightPdf)) {
+    add(wi, value, lightPdf, numeric_limits<float>::max());
+  }
+  const float3 us(iq::random(), iq::random(), iq::random());
+  if (world.sampleLight(p, n, time, us, wi, value, lightPdf, distance)) {
+    // Stop short of the light's own surface.
+    add(wi, value, lightPdf, distance * (1.0f - 1e-3f));
+  }
+  return direct;
+}
+
+// Structures radiance() learns from its paths and uses for later ones,
+// each optional.
+struct Caches {
+  iq::PathGuide *guide = nullptr;
+  iq::RadianceCache *radiance = nullptr;
+};
+
+// Probability of sampling the path guide instead of the BSDF where it has
+// learnt a distribution.
+constexpr float guideFraction = 0.5f;
+// Probability of tracing on and refreshing the radiance cache where it
+// could answer.
+constexpr float cacheRefresh = 0.1f;
+// Paths feed the cache from their first few vertices only, deeper ones
+// have too few bounces left and would darken it.
+constexpr int cacheDepth = 6;
+
+// bounce is null for camera rays and specular bounces, which light sampling
+// cannot produce. A guide is sampled and, while it learns, fed at
+// non-delta surfaces. The radiance cache is fed at diffuse surfaces and
+// answers for those reached by a diffuse or glossy bounce.
+float3 radiance(const Ray &ray, const World &world, int depth,
+                PrimaryHit *primary = nullptr, const Bounce *bounce = nullptr,
+                const Caches &caches = {}) {
+  const float tmin = numeric_limits<float>::min();
+  const float tmax = numeric_limits<float>::max();
+
+  if constexpr (iq::stats::enabled) {
+    ++iq::stats::local().raysByDepth[depth];
+  }
+  auto info = world.intersect(ray, tmin, tmax);
+  float t;
+  float3 albedo;
+  if (ray.medium != nullptr &&
+      ray.medium->sample(ray, info ? info->t : tmax, t, albedo)) {
+    if constexpr (iq::stats::enabled) {
+      ++iq::stats::local().scatters;
+    }
+    if (depth >= iq::maxDepth) {
+      if constexpr (iq::stats::enabled) {
+        ++iq::stats::local().depthLimited;
+      }
+      return float3(0.0f);
+    }
+    const Medium &medium = *ray.medium;
+    const float3 p = ray.pointAt(t);
+    const float3 wo = -ray.dir;
+    const auto spawn = [&](const float3 &wi) {
+      Ray shadow(p, wi);
+      shadow.time = ray.time;
+      shadow.medium = &medium;
+      return shadow;
+    };
+    const float3 direct = directLight(
+        world, p, float3(0.0f), ray.time, spawn,
+        [&](const float3 &wi, float &pdf) {
+          pdf = medium.phase(wo, wi);
+          return float3(pdf);
+        });
+    // Sampled in proportion to the phase function, which cancels.
+    const float2 u(iq::random(), iq::random());
+    Ray next = spawn(medium.samplePhase(wo, u));
+    const float pdf = medium.phase(wo, next.dir);
+    next.width = ray.width + ray.spread * t;
+    next.spread = std::max(ray.spread, 1.0f / std::sqrt(pdf));
+    const Bounce scattered{p, float3(0.0f), pdf};
+    return albedo * (direct + radiance(next, world, depth + 1, nullptr,
+                                       &scattered, caches));
+  }
+  if (info) {
+    if (info->material->boundary()) {
+      // Entering or leaving a medium continues the path unchanged.
+      Ray next = info->spawn(ray.dir, ray.spread);
+      next.medium = dot(ray.dir, info->normal) < 0.0f
+                        ? info->material->inside()
+                        : info->material->outside();
+      return radiance(next, world, depth, primary, bounce, caches);
+    }
+    if constexpr (iq::aov::enabled != 0) {
+      if (primary != nullptr) {
+        primary->t = info->t;
+        primary->normal = info->normal;
+        primary->albedo = info->material->albedo(*info);
+        primary->materialId = info->material->id();
+      }
+    }
+    float3 emitted = info->material->emission();
+    if (bounce != nullptr && iq::luminance(emitted) > 0.0f) {
+      const float lightPdf =
+          world.lightPdf(bounce->p, bounce->normal, ray.time, info->primitive);
+      emitted *= misWeight(bounce->pdf, lightPdf);
+    }
+    if (depth >= iq::maxDepth) {
+      if constexpr (iq::stats::enabled) {
+        ++iq::stats::local().depthLimited;
+      }
+      return emitted;
+    }
+    const float3 wo = -normalize(ray.dir);
+    const float3 n = dot(wo, info->normal) < 0.0f ? -info->normal
+                                                   : info->normal;
+    const auto spawn = [&](const float3 &wi) {
+      Ray next = info->spawn(wi, 0.0f);
+      next.medium = ray.medium;
+      return next;
+    };
+    const Material &material = *info->material;
+    iq::RadianceCache *cache = material.diffuse() ? caches.radiance : nullptr;
+    if (cache != nullptr && bounce != nullptr &&
+        iq::random() >= cacheRefresh) {
+      float3 cached;
+      if (cache->lookup(info->p, n, cached)) {
+        return emitted + material.albedo(*info) * cached;
+      }
+    }
+    // Reflected light over the albedo goes to the cache.
+    const auto shade = [&](const float3 &reflected) {
+      if (cache != nullptr && depth < cacheDepth) {
+        const float3 albedo = material.albedo(*info);
+        float3 value(0.0f);
+        for (int i = 0; i < 3; ++i) {
+          value[i] = albedo[i] > 0.0f ? reflected[i] / albedo[i] : 0.0f;
+        }
+        cache->record(info->p, n, value);
+      }
+      return emitted + reflected;
+    };
+    iq::PathGuide *guide = material.delta() ? nullptr : caches.guide;
+    const int voxel = guide != nullptr ? guide->find(info->p, n) : -1;
+    // Density of the BSDF and guide mixture.
+    const auto pdf = [&](const float3 &wi) {
+      const float bsdf = material.pdf(*info, wo, wi);
+      return voxel < 0 ? bsdf
+                       : (1.0f - guideFraction) * bsdf +
+                             guideFraction * guide->pdf(voxel, wi);
+    };
+    const float3 direct = directLight(
+        world, info->p, n, info->time, spawn,
+        [&](const float3 &wi, float &d) {
+          d = pdf(wi);
+          return material.eval(*info, wo, wi) * std::abs(dot(wi, info->normal));
+        });
+    const float2 u(iq::random(), iq::random());
+    BsdfSample sample;
+    if (voxel >= 0 && iq::random() < guideFraction) {
+      sample.wi = guide->sample(voxel, u);
+      sample.specular = false;
+    } else if (!material.sample(*info, wo, u, sample)) {
+      return shade(direct);
+    }
+    if (voxel >= 0) {
+      sample.f = material.eval(*info, wo, sample.wi);
+      sample.pdf = pdf(sample.wi);
+    }
+    if (sample.pdf <= 0.0f || maxelem(sample.f) <= 0.0f) {
+      return shade(direct);
+    }
+    if constexpr (iq::stats::enabled) {
+      ++iq::stats::local().scatters;
+    }
+    const float3 weight =
+        sample.f * (std::abs(dot(sample.wi, info->normal)) / sample.pdf);
+    Ray next = spawn(sample.wi);
+    // A lobe with density pdf spreads the cone over about 1/sqrt(pdf) rad.
+    next.spread = sample.specular
+                      ? ray.spread
+                      : std::max(ray.spread, 1.0f / sqrt(sample.pdf));
+    const Bounce scattered{info->p, n, sample.pdf};
+    const float3 incident =
+        radiance(next, world, depth + 1, nullptr,
+                 sample.specular ? nullptr : &scattered, caches);
+    if (guide != nullptr && guide->learning()) {
+      guide->record(info->p, n, sample.wi,
+                    iq::luminance(incident) / sample.pdf);
+    }
+    return shade(direct + weight * incident);
+  } else {
+    const Environment &environment = world.environment();
+    const float3 dir = normalize(ray.dir);
+    const float3 color = environment.eval(dir);
+    if constexpr (iq::aov::enabled != 0) {
+      if (primary != nullptr) {
+        primary->albedo = color;
+      }
+    }
+    return bounce != nullptr
+               ? color * misWeight(bounce->pdf, environment.pdf(dir))
+               : color;
+  }
+}
+
+// Per-pixel float32 radiance sums with Kahan compensated summation. The
+// compensation terms of the three channels are stored as signed 10-bit
+// fractions of an ulp of their sums, packed into the fourth component, so a
+// pixel takes one aligned float4 instead of a double3 and sums stay within
+// float rounding of the double result over millions of samples. The
+// fractions are rounded stochastically; rounding to nearest would repeat the
+// same error for every sample of a constant pixel, such as the sky.
+//
+// The storage is allocated untouched so that its pages are placed on the
+// NUMA node of the threads that first clear them; every pixel has to be
+// cleared before use.
+class Accumulator {
+public:
+  Accumulator(size_t size)
+      : m_pixels(static_cast<float4 *>(std::malloc(size * sizeof(float4)))),
+        m_size(size) {
+    if (!m_pixels) {
+      throw std::bad_alloc();
+    }
+  }
+
+  size_t size() const { return m_size; }
+
+  void clear() { clear(0, m_size); }
+
+  // Clears pixels [first, last).
+  void clear(size_t first, size_t last) {
+    const uint32_t zero = (512u << 20) | (512u << 10) | 512u;
+    float4 empty(0.0f);
+    std::memcpy(&empty.w, &zero, sizeof(zero));
+    for (size_t i = first; i < last; ++i) {
+      new (&m_pixels[i]) float4(empty);
+    }
+  }
+
+  void add(size_t i, const float3 &value) {
+    float4 &pixel = m_pixels[i];
+    uint32_t packed;
+    std::memcpy(&packed, &pixel.w, sizeof(packed));
+    uint32_t updated = 0;
+    for (int k = 0; k < 3; ++k) {
+      const float sum = pixel[k];
+      const float y = value[k] - compensation(packed, k, sum);
+      const float t = sum + y;
+      const float c = (t - sum) - y;
+      const int q =
+          int(std::floor(c / ulp(t) * 512.0f + dither(t, value[k], packed)));
+      updated |= uint32_t(std::min(511, std::max(-511, q)) + 512) << (10 * k);
+      pixel[k] = t;
+    }
+    std::memcpy(&pixel.w, &updated, sizeof(updated));
+  }
+
+  double3 sum(size_t i) const {
+    const float4 &pixel = m_pixels[i];
+    uint32_t packed;
+    std::memcpy(&packed, &pixel.w, sizeof(packed));
+    double3 result;
+    for (int k = 0; k < 3; ++k) {
+      result[k] = double(pixel[k]) - compensation(packed, k, pixel[k]);
+    }
+    return result;
+  }
+
+private:
+  // Spacing of floats around x, read off its exponent bits.
+  static float ulp(float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    bits &= 0x7f800000u;
+    if (bits == 0) {
+      return std::numeric_limits<float>::denorm_min();
+    }
+    float power;
+    std::memcpy(&power, &bits, sizeof(power));
+    return power * 0x1p-23f;
+  }
+  // Hash of the operands in [0, 1), the random number for rounding.
+  static float dither(float sum, float value, uint32_t packed) {
+    uint32_t a, b;
+    std::memcpy(&a, &sum, sizeof(a));
+    std::memcpy(&b, &value, sizeof(b));
+    uint32_t h = a * 0x9e3779b9u ^ (b + packed) * 0x85ebca6bu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return float(h >> 8) * 0x1p-24f;
+  }
+  static float compensation(uint32_t packed, int k, float sum) {
+    const int q = int((packed >> (10 * k)) & 1023u) - 512;
+    return float(q) * (ulp(sum) / 512.0f);
+  }
+
+  struct Free {
+    void operator()(float4 *p) const { std::free(p); }
+  };
+  std::unique_ptr<float4[], Free> m_pixels;
+  size_t m_size;
+};
+
+// Structure-of-arrays planes for the AOVs compiled in with IQ_AOVS. Depth,
+// normal and albedo are summed per sample and averaged on output, material
+// id keeps the last sample and sample count counts them.
+class AovBuffers {
+public:
+  AovBuffers(size_t size) {
+    using namespace iq::aov;
+    if (enabled & Depth) {
+      m_depth.resize(size);
+    }
+    for (int k = 0; k < 3; ++k) {
+      if (enabled & Normal) {
+        m_normal[k].resize(size);
+      }
+      if (enabled & Albedo) {
+        m_albedo[k].resize(size);
+      }
+    }
+    if (enabled & MaterialId) {
+      m_materialId.resize(size);
+    }
+    if (enabled & SampleCount) {
+      m_sampleCount.resize(size);
+    }
+  }
+
+  void clear() {
+    std::fill(m_depth.begin(), m_depth.end(), 0.0f);
+    for (int k = 0; k < 3; ++k) {
+      std::fill(m_normal[k].begin(), m_normal[k].end(), 0.0f);
+      std::fill(m_albedo[k].begin(), m_albedo[k].end(), 0.0f);
+    }
+    std::fill(m_materialId.begin(), m_materialId.end(), 0);
+    std::fill(m_sampleCount.begin(), m_sampleCount.end(), 0);
+  }
+
+  void add(size_t i, const PrimaryHit &hit) {
+    using namespace iq::aov;
+    if constexpr ((enabled & Depth) != 0) {
+      m_depth[i] += hit.t;
+    }
+    for (int k = 0; k < 3; ++k) {
+      if constexpr ((enabled & Normal) != 0) {
+        m_normal[k][i] += hit.normal[k];
+      }
+      if constexpr ((enabled & Albedo) != 0) {
+        m_albedo[k][i] += hit.albedo[k];
+      }
+    }
+    if constexpr ((enabled & MaterialId) != 0) {
+      m_materialId[i] = hit.materialId;
+    }
+    if constexpr ((enabled & SampleCount) != 0) {
+      ++m_sampleCount[i];
+    }
+  }
+
+  const vector<float> &depth() const { return m_depth; }
+  const vector<float> &normal(int k) const { return m_normal[k]; }
+  const vector<float> &albedo(int k) const { return m_albedo[k]; }
+
+  // Writes <prefix>.<aov>.pfm for every AOV compiled in.
+  bool write(const string &prefix, size_t width, size_t height,
+             size_t samples) const;
+
+private:
+  vector<float> m_depth;
+  vector<float> m_normal[3];
+  vector<float> m_albedo[3];
+  vector<uint32_t> m_materialId;
+  vector<uint32_t> m_sampleCount;
+};
+
+// Linear float image writers. They pull one scanline at a time from a row
+// source, e.g. the accumulated radiance scaled by 1/samples, so no full size
+// copy of the framebuffer is made. All assume a little-endian host.
+namespace iq {
+// Fills row with the linear values of image row y.
+using RowSource = std::function<void(size_t y, float3 *row)>;
+
+RowSource accumulatedRows(const Accumulator &accumulation, size_t width,
+                          double scale) {
+  return [&accumulation, width, scale](size_t y, float3 *row) {
+    for (size_t x = 0; x < width; ++x) {
+      row[x] = float3(accumulation.sum(x + y * width) * scale);
+    }
+  };
+}
+
+// Root mean square error over all channels against a reference image.
+double rmse(const RowSource &source, const vector<float3> &reference,
+            size_t width, size_t height) {
+  vector<float3> row(width);
+  double sum = 0.0;
+  for (size_t y = 0; y < height; ++y) {
+    source(y, row.data());
+    for (size_t x = 0; x < width; ++x) {
+      const float3 d = row[x] - reference[x + y * width];
+      sum += double(dot(d, d));
+    }
+  }
+  return std::sqrt(sum / double(3 * width * height));
+}
+
+// Portable float map, rows are stored bottom to top.
+bool writePfm(const string &filename, size_t width, size_t height,
+              const RowSource &source) {
+  std::ofstream file(filename, std::ios::binary);
+  file << "PF\n" << width << " " << height << "\n-1.0\n";
+  vector<float3> row(width);
+  for (size_t y = height; y-- > 0;) {
+    source(y, row.data());
+    file.write(reinterpret_cast<const char *>(row.data()),
+               row.size() * sizeof(float3));
+  }
+  return bool(file);
+}
+
+// Uncompressed scanline OpenEXR with 32-bit float B, G and R channels.
+bool writeExr(const string &filename, size_t width, size_t height,
+              const RowSource &source) {
+  std::ofstream file(filename, std::ios::binary);
+  auto put = [&](const auto &value) {
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  auto attribute = [&](const char *name, const char *type, int32_t size) {
+    file.write(name, strlen(name) + 1);
+    file.write(type, strlen(type) + 1);
+    put(size);
+  };
+
+  put(int32_t(20000630));
+  put(int32_t(2));
+
+  // Channels have to be listed in alphabetical order.
+  attribute("channels", "chlist", 3 * 18 + 1);
+  for (const char *channel : {"B", "G", "R"}) {
+    file.write(channel, 2);
+    put(int32_t(2)); // FLOAT
+    put(int32_t(0)); // pLinear and reserved bytes
+    put(int32_t(1)); // xSampling
+    put(int32_t(1)); // ySampling
+  }
+  file.put(0);
+  attribute("compression", "compression", 1);
+  file.put(0);
+  const int32_t window[] = {0, 0, int32_t(width) - 1, int32_t(height) - 1};
+  attribute("dataWindow", "box2i", sizeof(window));
+  put(window);
+  attribute("displayWindow", "box2i", sizeof(window));
+  put(window);
+  attribute("lineOrder", "lineOrder", 1);
+  file.put(0);
+  attribute("pixelAspectRatio", "float", 4);
+  put(1.0f);
+  attribute("screenWindowCenter", "v2f", 8);
+  put(0.0f);
+  put(0.0f);
+  attribute("screenWindowWidth", "float", 4);
+  put(1.0f);
+  file.put(0);
+
+  // Offset table, one single-scanline chunk per row.
+  const int32_t dataSize = int32_t(width * 3 * sizeof(float));
+  const uint64_t chunkSize = 2 * sizeof(int32_t) + dataSize;
+  const uint64_t first = uint64_t(file.tellp()) + height * sizeof(uint64_t);
+  for (size_t y = 0; y < height; ++y) {
+    put(first + y * chunkSize);
+  }
+
+  vector<float3> row(width);
+  vector<float> planar(width);
+  for (size_t y = 0; y < height; ++y) {
+    source(y, row.data());
+    put(int32_t(y));
+    put(dataSize);
+    for (int channel = 2; channel >= 0; --channel) {
+      for (size_t x = 0; x < width; ++x) {
+        planar[x] = row[x][channel];
+      }
+      file.write(reinterpret_cast<const char *>(planar.data()),
+                 width * sizeof(float));
+    }
+  }
+  return bool(file);
+}
+
+// Radiance RGBE with flat (not run-length encoded) scanlines. The vendored
+// stbi_write_hdr computes a wrong row stride for images taller than a row.
+bool writeHdr(const string &filename, size_t width, size_t height,
+              const RowSource &source) {
+  std::ofstream file(filename, std::ios::binary);
+  file << "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y " << height << " +X "
+       << width << "\n";
+  vector<float3> row(width);
+  vector<uint8_t> rgbe(width * 4);
+  for (size_t y = 0; y < height; ++y) {
+    source(y, row.data());
+    for (size_t x = 0; x < width; ++x) {
+      const float m = maxelem(row[x]);
+      uint8_t *out = &rgbe[4 * x];
+      if (m < 1e-32f) {
+        out[0] = out[1] = out[2] = out[3] = 0;
+        continue;
+      }
+      int exponent;
+      const float f = frexp(m, &exponent) * 256.0f / m;
+      out[0] = uint8_t(row[x].x * f);
+      out[1] = uint8_t(row[x].y * f);
+      out[2] = uint8_t(row[x].z * f);
+      out[3] = uint8_t(exponent + 128);
+    }
+    file.write(reinterpret_cast<const char *>(rgbe.data()), rgbe.size());
+  }
+  return bool(file);
+}
+
+bool writeLinear(const string &filename, size_t width, size_t height,
+                 const RowSource &source) {
+  const string extension = filename.substr(filename.find_last_of('.') + 1);
+  if (extension == "pfm") {
+    return writePfm(filename, width, height, source);
+  } else if (extension == "exr") {
+    return writeExr(filename, width, height, source);
+  } else if (extension == "hdr") {
+    return writeHdr(filename, width, height, source);
+  }
+  return false;
+}
+
+// PFM from one (grayscale) or three (color) float planes.
+bool writePlanes(const string &filename, size_t width, size_t height,
+                 const vector<const float *> &planes, float scale) {
+  std::ofstream file(filename, std::ios::binary);
+  file << (planes.size() == 1 ? "Pf\n" : "PF\n") << width << " " << height
+       << "\n-1.0\n";
+  vector<float> row(width * planes.size());
+  for (size_t y = height; y-- > 0;) {
+    for (size_t x = 0; x < width; ++x) {
+      for (size_t k = 0; k < planes.size(); ++k) {
+        row[x * planes.size() + k] = planes[k][x + y * width] * scale;
+      }
+    }
+    file.write(reinterpret_cast<const char *>(row.data()),
+               row.size() * sizeof(float));
+  }
+  return bool(file);
+}
+} // namespace iq
+
+bool AovBuffers::write(const string &prefix, size_t width, size_t height,
+                       size_t samples) const {
+  using namespace iq::aov;
+  const float scale = 1.0f / float(samples);
+  bool ok = true;
+  if (enabled & Depth) {
+    ok &= iq::writePlanes(prefix + ".depth.pfm", width, height,
+                          {m_depth.data()}, scale);
+  }
+  if (enabled & Normal) {
+    ok &= iq::writePlanes(
+        prefix + ".normal.pfm", width, height,
+        {m_normal[0].data(), m_normal[1].data(), m_normal[2].data()}, scale);
+  }
+  if (enabled & Albedo) {
+    ok &= iq::writePlanes(
+        prefix + ".albedo.pfm", width, height,
+        {m_albedo[0].data(), m_albedo[1].data(), m_albedo[2].data()}, scale);
+  }
+  if (enabled & MaterialId) {
+    const vector<float> id(m_materialId.begin(), m_materialId.end());
+    ok &= iq::writePlanes(prefix + ".id.pfm", width, height, {id.data()},
+                          1.0f);
+  }
+  if (enabled & SampleCount) {
+    const vector<float> count(m_sampleCount.begin(), m_sampleCount.end());
+    ok &= iq::writePlanes(prefix + ".samples.pfm", width, height,
+                          {count.data()}, 1.0f);
+  }
+  return ok;
+}
+
+namespace iq {
+// Per-pixel render cost as a false color PNG (inferno-like ramp), scaled so
+// the 99th percentile maps to the top of the ramp; a .pfm filename writes
+// the raw mean nanoseconds per sample instead.
+bool writeHeatmap(const string &filename, size_t width, size_t height,
+                  const vector<float> &cost, size_t samples) {
+  const float scale = 1.0f / float(samples);
+  if (filename.substr(filename.find_last_of('.') + 1) == "pfm") {
+    return writePlanes(filename, width, height, {cost.data()}, scale);
+  }
+
+  vector<float> sorted(cost);
+  auto percentile = sorted.begin() + sorted.size() * 99 / 100;
+  std::nth_element(sorted.begin(), percentile, sorted.end());
+  const float top = std::max(*percentile, numeric_limits<float>::min());
+
+  const float3 ramp[] = {{0, 0, 4},       {87, 16, 110},  {188, 55, 84},
+                         {249, 142, 9},   {252, 255, 164}};
+  vector<byte3> pixels(cost.size());
+  for (size_t i = 0; i < cost.size(); ++i) {
+    const float t = std::min(cost[i] / top, 1.0f) * 4.0f;
+    const int k = std::min(int(t), 3);
+    pixels[i] = byte3(lerp(ramp[k], ramp[k + 1], t - float(k)) + 0.5f);
+  }
+  return stbi_write_png(filename.c_str(), int(width), int(height), 3,
+                        pixels.data(), int(width * 3)) != 0;
+}
+} // namespace iq
+
+// Runs body(y0, y1) over horizontal bands of the image, one band per
+// worker slot.
+template <typename Body> void parallelRows(size_t height, const Body &body) {
+  const size_t threads = iq::numa::workerCount();
+  const size_t band = (height + threads - 1) / threads;
+
+  vector<thread> workers;
+  for (size_t i = 0; i < threads; ++i) {
+    const size_t y0 = std::min(height, i * band);
+    const size_t y1 = std::min(height, y0 + band);
+    workers.emplace_back([&body, i, y0, y1]() {
+      iq::numa::enter(i);
+      body(y0, y1);
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+// Splits the image into square tiles rendered by one worker per worker slot.
+// Tiles are ordered, dealt round-robin into per-worker deques, and every
+// worker takes from the front of its own deque, then steals from the back of
+// the others once it runs dry. Batch renders order tiles by their cost in
+// the previous pass so expensive tiles start first and cheap ones fill the
+// end of the pass; previews, and the first pass, go center-first.
+//
+// On NUMA machines every node owns a horizontal band of tiles, which is
+// dealt to its own workers only, and workers steal from their node before
+// they cross to another, so framebuffer pages first touched by a node stay
+// mostly accessed from it.
+namespace iq {
+class TileScheduler {
+public:
+  enum class Order { Cost, CenterFirst };
+
+  struct Tile {
+    size_t x0, y0, x1, y1;
+  };
+
+  TileScheduler(size_t width, size_t height, size_t size = 32)
+      : m_width(width), m_height(height) {
+    for (size_t y = 0; y < height; y += size) {
+      for (size_t x = 0; x < width; x += size) {
+        m_tiles.push_back(
+            {x, y, std::min(width, x + size), std::min(height, y + size)});
+      }
+    }
+    m_cost.assign(m_tiles.size(), 0.0f);
+    const size_t nodes = numa::placement().nodes();
+    const size_t rows = (height + size - 1) / size;
+    for (const Tile &tile : m_tiles) {
+      m_node.push_back(uint32_t(tile.y0 / size * nodes / rows));
+    }
+  }
+
+  void setOrder(Order order) { m_order = order; }
+
+  // Forgets the measured costs, e.g. after the camera moved.
+  void reset() { std::fill(m_cost.begin(), m_cost.end(), 0.0f); }
+
+  // Calls body(tile, index) once for every tile. Without stealing every tile
+  // is handled by a worker of its own node, e.g. to first-touch memory.
+  template <typename Body> void run(const Body &body, bool steal = true);
+
+private:
+  // Tile indices [head, tail) of a worker, both packed into one atomic so
+  // the owner and thieves claim tiles with a single compare-exchange.
+  struct Queue {
+    std::atomic<uint64_t> range{0};
+    vector<uint32_t> tiles;
+
+    bool pop(uint32_t &tile, bool back) {
+      uint64_t r = range.load(std::memory_order_relaxed);
+      for (;;) {
+        const uint32_t head = uint32_t(r), tail = uint32_t(r >> 32);
+        if (head >= tail) {
+          return false;
+        }
+        const uint64_t next = back ? uint64_t(tail - 1) << 32 | head
+                                   : uint64_t(tail) << 32 | (head + 1);
+        if (range.compare_exchange_weak(r, next, std::memory_order_acquire,
+                                        std::memory_order_relaxed)) {
+          tile = tiles[back ? tail - 1 : head];
+          return true;
+        }
+      }
+    }
+  };
+
+  vector<uint32_t> order() const {
+    vector<uint32_t> indices(m_tiles.size());
+    for (size_t i = 0; i < indices.size(); ++i) {
+      indices[i] = uint32_t(i);
+    }
+    const bool measured = std::any_of(m_cost.begin(), m_cost.end(),
+                                      [](float c) { return c > 0.0f; });
+    if (m_order == Order::Cost && measured) {
+      std::stable_sort(indices.begin(), indices.end(),
+                       [&](uint32_t a, uint32_t b) {
+                         return m_cost[a] > m_cost[b];
+                       });
+      return indices;
+    }
+    auto distance = [&](uint32_t i) {
+      const Tile &t = m_tiles[i];
+      const float dx = float(t.x0 + t.x1) - float(m_width);
+      const float dy = float(t.y0 + t.y1) - float(m_height);
+      return dx * dx + dy * dy;
+    };
+    std::stable_sort(indices.begin(), indices.end(),
+                     [&](uint32_t a, uint32_t b) {
+                       return distance(a) < distance(b);
+                     });
+    return indices;
+  }
+
+  size_t m_width, m_height;
+  vector<Tile> m_tiles;
+  // NUMA node owning every tile.
+  vector<uint32_t> m_node;
+  // Seconds spent on every tile during the last run.
+  vector<float> m_cost;
+  Order m_order = Order::Cost;
+};
+
+template <typename Body>
+void TileScheduler::run(const Body &body, bool steal) {
+  const numa::Placement &placement = numa::placement();
+  const size_t threads = placement.slots.size();
+  vector<vector<size_t>> slots(placement.nodes());
+  for (size_t i = 0; i < threads; ++i) {
+    slots[placement.slots[i].node].push_back(i);
+  }
+
+  const vector<uint32_t> indices = order();
+  vector<Queue> queues(threads);
+  vector<size_t> dealt(placement.nodes(), 0);
+  for (uint32_t tile : indices) {
+    const vector<size_t> &local = slots[m_node[tile]];
+    queues[local[dealt[m_node[tile]]++ % local.size()]].tiles.push_back(tile);
+  }
+  for (auto &queue : queues) {
+    queue.range.store(uint64_t(queue.tiles.size()) << 32);
+  }
+
+  auto work = [&](size_t self) {
+    numa::enter(self);
+    const int node = placement.slots[self].node;
+    // Own queue first, then the rest of the node, then the other nodes.
+    vector<size_t> victims = {self};
+    if (steal) {
+      for (int pass = 0; pass < 2; ++pass) {
+        for (size_t k = 1; k < threads; ++k) {
+          const size_t other = (self + k) % threads;
+          if ((placement.slots[other].node == node) == (pass == 0)) {
+            victims.push_back(other);
+          }
+        }
+      }
+    }
+    uint32_t tile;
+    for (size_t victim : victims) {
+      Queue &queue = queues[victim];
+      while (queue.pop(tile, victim != self)) {
+        const auto begin = chrono::steady_clock::now();
+        body(m_tiles[tile], size_t(tile));
+        const chrono::duration<float> elapsed =
+            chrono::steady_clock::now() - begin;
+        m_cost[tile] = elapsed.count();
+      }
+    }
+  };
+  vector<thread> workers;
+  for (size_t i = 0; i < threads; ++i) {
+    workers.emplace_back(work, i);
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+} // namespace iq
+
+// Photon mapping, the alternative integrator for light that reaches
+// diffuse surfaces through glass or mirrors, which paths from the camera
+// rarely find. Every pass traces photons from the emitters, stores them at
+// diffuse and glossy surfaces and estimates the indirect light at the first
+// such surface seen from the camera from the photons around it.
+// Progressive photon mapping (Knaus and Zwicker, "Progressive Photon
+// Mapping: A Probabilistic Approach", 2011) shrinks the gather radius from
+// pass to pass, so the average over passes converges.
+namespace iq {
+// Flux arriving at p from direction wi.
+struct Photon {
+  float3 p;
+  float3 wi;
+  float3 power;
+};
+
+// Hash grid of cubic cells twice the gather radius wide, so a lookup visits
+// at most 2x2x2 cells. Cells are hashed into a power of two number of
+// buckets and the photons are ordered by bucket with one counting sort.
+class PhotonGrid {
+public:
+  PhotonGrid(const vector<Photon> &photons, float radius)
+      : m_radius(radius), m_inverseCell(0.5f / radius) {
+    size_t buckets = 1;
+    while (buckets < 2 * photons.size()) {
+      buckets *= 2;
+    }
+    m_mask = buckets - 1;
+    m_start.assign(buckets + 1, 0);
+    vector<uint32_t> bucket(photons.size());
+    for (size_t i = 0; i < photons.size(); ++i) {
+      bucket[i] = hash(cell(photons[i].p));
+      ++m_start[bucket[i] + 1];
+    }
+    std::partial_sum(m_start.begin(), m_start.end(), m_start.begin());
+    vector<uint32_t> next(m_start.begin(), m_start.end() - 1);
+    m_photons.resize(photons.size());
+    for (size_t i = 0; i < photons.size(); ++i) {
+      m_photons[next[bucket[i]]++] = photons[i];
+    }
+  }
+
+  float radius() const { return m_radius; }
+  size_t size() const { return m_photons.size(); }
+
+  // Calls f(photon) for every photon within the radius of p.
+  template <typename F> void query(const float3 &p, const F &f) const {
+    const int3 lo = cell(p - m_radius), hi = cell(p + m_radius);
+    uint32_t visited[8];
+    size_t count = 0;
+    for (int z = lo.z; z <= hi.z; ++z) {
+      for (int y = lo.y; y <= hi.y; ++y) {
+        for (int x = lo.x; x <= hi.x; ++x) {
+          const uint32_t bucket = hash(int3(x, y, z));
+          if (std::find(visited, visited + count, bucket) !=
+              visited + count) {
+            continue;
+          }
+          visited[count++] = bucket;
+          for (uint32_t i = m_start[bucket]; i < m_start[bucket + 1]; ++i) {
+            const float3 d = m_photons[i].p - p;
+            if (dot(d, d) < m_radius * m_radius) {
+              f(m_photons[i]);
+            }
+          }
+        }
+      }
+    }
+  }
+
+private:
+  int3 cell(const float3 &p) const { return int3(floor(p * m_inverseCell)); }
+  uint32_t hash(const int3 &c) const {
+    return (uint32_t(c.x) * 73856093u ^ uint32_t(c.y) * 19349663u ^
+            uint32_t(c.z) * 83492791u) &
+           m_mask;
+  }
+
+  float m_radius;
+  float m_inverseCell;
+  uint32_t m_mask;
+  vector<uint32_t> m_start; // per bucket, plus the end
+  vector<Photon> m_photons;
+};
+
+// Gather radius of pass index pass (from 0): r^2 shrinks by (i + alpha) /
+// (i + 1) after pass i, with alpha = 2/3.
+inline float photonRadius(float initial, size_t pass) {
+  constexpr float alpha = 2.0f / 3.0f;
+  float scale = 1.0f;
+  for (size_t i = 1; i <= pass; ++i) {
+    scale *= (float(i) + alpha) / float(i + 1);
+  }
+  return initial * std::sqrt(scale);
+}
+} // namespace iq
+
+// Traces count photons and keeps those arriving at diffuse or glossy
+// surfaces after at least one scattering event; light sampling accounts
+// for the direct light. Powers are per photon of the pass.
+vector<iq::Photon> tracePhotons(const World &world, size_t count) {
+  const float tmin = numeric_limits<float>::min();
+  const float tmax = numeric_limits<float>::max();
+  vector<iq::Photon> photons;
+  std::mutex mutex;
+  parallelRows(count, [&](size_t begin, size_t end) {
+    iq::trace::Zone zone("photons");
+    vector<iq::Photon> local;
+    for (size_t i = begin; i < end; ++i) {
+      Ray ray;
+      float3 power;
+      if (!world.emitPhoton(ray, power)) {
+        break;
+      }
+      power /= float(count);
+      const float emitted = iq::luminance(power);
+      for (int bounces = 0; bounces < iq::maxDepth;) {
+        const auto info = world.intersect(ray, tmin, tmax);
+        float t;
+        float3 albedo;
+        if (ray.medium != nullptr &&
+            ray.medium->sample(ray, info ? info->t : tmax, t, albedo)) {
+          const Medium *medium = ray.medium;
+          const float2 u(iq::random(), iq::random());
+          const float time = ray.time;
+          ray = Ray(ray.pointAt(t), medium->samplePhase(-ray.dir, u));
+          ray.medium = medium;
+          ray.time = time;
+          power *= albedo;
+        } else if (!info) {
+          break;
+        } else if (info->material->boundary()) {
+          const Medium *medium = dot(ray.dir, info->normal) < 0.0f
+                                     ? info->material->inside()
+                                     : info->material->outside();
+          ray = info->spawn(ray.dir, 0.0f);
+          ray.medium = medium;
+          continue;
+        } else {
+          const Material &material = *info->material;
+          const float3 wo = -ray.dir;
+          if (bounces > 0 && !material.delta()) {
+            local.push_back({info->p, wo, power});
+          }
+          const float2 u(iq::random(), iq::random());
+          BsdfSample sample;
+          if (!material.sample(*info, wo, u, sample) || sample.pdf <= 0.0f) {
+            break;
+          }
+          power *=
+              sample.f * (std::abs(dot(sample.wi, info->normal)) / sample.pdf);
+          const Medium *medium = ray.medium;
+          ray = info->spawn(sample.wi, 0.0f);
+          ray.medium = medium;
+        }
+        // Russian roulette keeps the surviving photons' power near the
+        // emitted power.
+        if (++bounces >= 3) {
+          const float survival =
+              std::min(0.95f, iq::luminance(power) / emitted);
+          if (!(iq::random() < survival)) {
+            break;
+          }
+          power /= survival;
+        }
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    photons.insert(photons.end(), local.begin(), local.end());
+  });
+  return photons;
+}
+
+// Camera paths for photon mapping. They follow delta bounces and end at
+// the first diffuse or glossy surface with its emission, light sampling
+// for the direct light at full weight and the photon estimate for the
+// rest. Paths entering a medium are finished by radiance().
+float3 photonRadiance(const Ray &ray, const World &world,
+                      const iq::PhotonGrid &photons, int depth,
+                      PrimaryHit *primary = nullptr) {
+  if (ray.medium != nullptr) {
+    return radiance(ray, world, depth, primary);
+  }
+  const float tmin = numeric_limits<float>::min();
+  const float tmax = numeric_limits<float>::max();
+
+  if constexpr (iq::stats::enabled) {
+    ++iq::stats::local().raysByDepth[depth];
+  }
+  const auto info = world.intersect(ray, tmin, tmax);
+  if (!info) {
+    const float3 color = world.environment().eval(normalize(ray.dir));
+    if constexpr (iq::aov::enabled != 0) {
+      if (primary != nullptr) {
+        primary->albedo = color;
+      }
+    }
+    return color;
+  }
+  const Material &material = *info->material;
+  if (material.boundary()) {
+    Ray next = info->spawn(ray.dir, ray.spread);
+    next.medium = dot(ray.dir, info->normal) < 0.0f ? material.inside()
+                                                    : material.outside();
+    return photonRadiance(next, world, photons, depth, primary);
+  }
+  if constexpr (iq::aov::enabled != 0) {
+    if (primary != nullptr) {
+      primary->t = info->t;
+      primary->normal = info->normal;
+      primary->albedo = material.albedo(*info);
+      primary->materialId = material.id();
+    }
+  }
+  const float3 emitted = material.emission();
+  const float3 wo = -normalize(ray.dir);
+  if (material.delta()) {
+    const float2 u(iq::random(), iq::random());
+    BsdfSample sample;
+    if (depth >= iq::maxDepth || !material.sample(*info, wo, u, sample) ||
+        sample.pdf <= 0.0f) {
+      return emitted;
+    }
+    const float3 weight =
+        sample.f * (std::abs(dot(sample.wi, info->normal)) / sample.pdf);
+    Ray next = info->spawn(sample.wi, ray.spread);
+    next.medium = ray.medium;
+    return emitted +
+           weight * photonRadiance(next, world, photons, depth + 1);
+  }
+  const float3 n = dot(wo, info->normal) < 0.0f ? -info->normal
+                                                 : info->normal;
+  const auto spawn = [&](const float3 &wi) { return info->spawn(wi, 0.0f); };
+  const float3 direct = directLight(
+      world, info->p, n, info->time, spawn, [&](const float3 &wi, float &pdf) {
+        pdf = 0.0f;
+        return material.eval(*info, wo, wi) * std::abs(dot(wi, info->normal));
+      });
+  float3 gathered(0.0f);
+  photons.query(info->p, [&](const iq::Photon &photon) {
+    gathered += photon.power * material.eval(*info, wo, photon.wi);
+  });
+  const float r = photons.radius();
+  return emitted + direct + gathered / (iq::pi * r * r);
+}
+
+// Focus distance for a camera at eye looking at at: the distance to the
+// first surface hit by the primary ray through the image center, looking
+// through medium boundaries, or to at if the ray escapes.
+float autofocus(const World &world, const float3 &eye, const float3 &at) {
+  const float3 dir = normalize(at - eye);
+  Ray ray(eye, dir);
+  for (int i = 0; i < iq::maxDepth; ++i) {
+    const auto info = world.intersect(ray, numeric_limits<float>::min(),
+                                      numeric_limits<float>::max());
+    if (!info) {
+      break;
+    }
+    if (!info->material->boundary()) {
+      return dot(info->p - eye, dir);
+    }
+    ray = info->spawn(dir, 0.0f);
+  }
+  return length(at - eye);
+}
+
+// Adds one sample per pixel of linear radiance to the accumulation buffer,
+// by path tracing with the given caches or, given photons, by photon
+// mapping. Every worker traces against the scene of its NUMA node in
+// worlds. Primary hits are recorded into aovs and the time spent per pixel,
+// in nanoseconds, is added to cost unless they are null.
+void renderPass(const Camera &camera, const vector<const World *> &worlds,
+                size_t width, size_t height, iq::TileScheduler &scheduler,
+                Accumulator &accumulation, AovBuffers *aovs,
+                vector<float> *cost, const iq::PhotonGrid *photons,
+                const Caches &caches) {
+  scheduler.run([&](const iq::TileScheduler::Tile &tile, size_t index) {
+    iq::trace::Zone zone("render", int64_t(index));
+    const World &world = *worlds[iq::numa::currentNode()];
+    const float spread = camera.pixelSpread(height);
+    for (size_t y = tile.y0; y < tile.y1; y++) {
+      for (size_t x = tile.x0; x < tile.x1; x++) {
+        const auto begin = cost != nullptr ? chrono::steady_clock::now()
+                                           : chrono::steady_clock::time_point();
+        const float u = float(x + iq::random()) / float(width);
+        const float v = float(y + iq::random()) / float(height);
+
+        Ray ray = camera.generate(u, v);
+        ray.spread = spread;
+        ray.time = iq::random();
+        PrimaryHit primary;
+        PrimaryHit *hit = aovs != nullptr ? &primary : nullptr;
+        const float3 rgb = photons != nullptr
+                               ? photonRadiance(ray, world, *photons, 0, hit)
+                               : radiance(ray, world, 0, hit, nullptr, caches);
+
+        accumulation.add(x + y * width, rgb);
+        if (aovs != nullptr) {
+          aovs->add(x + y * width, primary);
+        }
+        if (cost != nullptr) {
+          const chrono::duration<float, std::nano> elapsed =
+              chrono::steady_clock::now() - begin;
+          (*cost)[x + y * width] += elapsed.count();
+        }
+      }
+    }
+  });
+}
+
+// Display transform applied once per snapshot: exposure, an optional filmic
+// curve and the encoding to 8-bit display values.
+namespace iq {
+enum class Tonemap { Gamma, Srgb, Aces };
+
+struct Display {
+  Tonemap tonemap = Tonemap::Gamma;
+  float exposure = 0.0f; // in stops
+};
+
+// Narkowicz's fit of the ACES reference rendering transform.
+inline float aces(float x) {
+  return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+}
+
+inline float srgb(float x) {
+  return x <= 0.0031308f ? 12.92f * x
+                          : 1.055f * std::pow(x, 1.0f / 2.4f) - 0.055f;
+}
+
+// One row at a time in interleaved float form so the branch-free inner loops
+// vectorize; the mode is a template parameter to keep them free of switches.
+// Gamma and Aces encode with the renderer's original gamma 2 (sqrt).
+template <Tonemap mode>
+void tonemapRow(float *p, byte3 *out, size_t width, float scale) {
+  for (size_t i = 0; i < 3 * width; ++i) {
+    float c = p[i] * scale;
+    if (mode == Tonemap::Aces) {
+      c = aces(c);
+    }
+    c = std::min(std::max(c, 0.0f), 1.0f);
+    p[i] = mode == Tonemap::Srgb ? c : std::sqrt(c);
+  }
+  if (mode == Tonemap::Srgb) {
+    for (size_t i = 0; i < 3 * width; ++i) {
+      p[i] = srgb(p[i]);
+    }
+  }
+  uint8_t *bytes = reinterpret_cast<uint8_t *>(out);
+  for (size_t i = 0; i < 3 * width; ++i) {
+    bytes[i] = uint8_t(255.0f * p[i] + 0.5f);
+  }
+}
+
+// Converts linear rows into PNG-ready rows in parallel. source(y, row) fills
+// row with the 3 * width linear values of image row y.
+template <typename Source>
+void tonemap(const Display &display, size_t width, size_t height,
+             const Source &source, vector<byte3> &pixels) {
+  const float scale = std::exp2(display.exposure);
+  parallelRows(height, [&](size_t y0, size_t y1) {
+    vector<float> row(3 * width);
+    for (size_t y = y0; y < y1; ++y) {
+      source(y, row.data());
+      byte3 *out = &pixels[y * width];
+      switch (display.tonemap) {
+      case Tonemap::Gamma:
+        tonemapRow<Tonemap::Gamma>(row.data(), out, width, scale);
+        break;
+      case Tonemap::Srgb:
+        tonemapRow<Tonemap::Srgb>(row.data(), out, width, scale);
+        break;
+      case Tonemap::Aces:
+        tonemapRow<Tonemap::Aces>(row.data(), out, width, scale);
+        break;
+      }
+    }
+  });
+}
+
+void tonemap(const Display &display, const Accumulator &accumulation,
+             size_t width, size_t height, size_t samples,
+             vector<byte3> &pixels) {
+  const double scale = 1.0 / double(samples);
+  tonemap(
+      display, width, height,
+      [&](size_t y, float *row) {
+        for (size_t x = 0; x < width; ++x) {
+          const float3 value(accumulation.sum(x + y * width) * scale);
+          row[3 * x + 0] = value.x;
+          row[3 * x + 1] = value.y;
+          row[3 * x + 2] = value.z;
+        }
+      },
+      pixels);
+}
+} // namespace iq
+
+// Edge-avoiding a-trous wavelet denoiser (Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering", 2010).
+// Color is divided by the albedo AOV so texture detail is not blurred, then
+// filtered with a 5x5 B3-spline kernel of growing step whose taps are
+// weighted by color, normal and albedo similarity, and finally multiplied
+// back. Missing features (see IQ_AOVS) are simply not used as guides.
+namespace iq {
+struct Denoiser {
+  int iterations = 5;
+  float sigmaColor = 0.6f;
+  float sigmaNormal = 0.2f;
+  float sigmaAlbedo = 0.1f;
+
+  void operator()(size_t width, size_t height, size_t samples,
+                  const Accumulator &accumulation, const AovBuffers &aovs,
+                  vector<float3> &out) const;
+};
+
+// exp(x) for x <= 0 from a polynomial for 2^f and the exponent bits; unlike
+// std::exp it does not keep the filter loops from vectorizing. Arguments are
+// compressed smoothly into (-87, 0] to stay within the float exponent range
+// without a branch; weights that matter change by less than a percent.
+inline float fastExp(float x) {
+  x = x * 87.0f / (87.0f - x);
+  const float y = x * 1.44269504f;
+  const int i = int(y);
+  const float f = (y - float(i)) * 0.69314718f;
+  const float p = 1.0f + f * (1.0f + f * (0.5f + f * (0.16666667f +
+                                                      f * (0.04166667f +
+                                                           f * 0.00833333f))));
+  const int32_t bits = (i + 127) << 23;
+  float scale;
+  std::memcpy(&scale, &bits, sizeof(scale));
+  return p * scale;
+}
+
+// Color, normal and albedo planes at the start of a row.
+struct Planes {
+  const float *color[3];
+  const float *normal[3];
+  const float *albedo[3];
+};
+
+// Adds the contribution of the tap at offset to pixels [x0, x1) of a row.
+// Kept out of line with everything passed by value so the loop vectorizes.
+void atrousTap(const Planes &p, long offset, size_t x0, size_t x1, float h,
+               float invColor, float invNormal, float invAlbedo,
+               float *__restrict w, float *__restrict s0,
+               float *__restrict s1, float *__restrict s2) {
+  const float *pc0 = p.color[0], *pc1 = p.color[1], *pc2 = p.color[2];
+  const float *pn0 = p.normal[0], *pn1 = p.normal[1], *pn2 = p.normal[2];
+  const float *pa0 = p.albedo[0], *pa1 = p.albedo[1], *pa2 = p.albedo[2];
+  const float *qc0 = pc0 + offset, *qc1 = pc1 + offset, *qc2 = pc2 + offset;
+  const float *qn0 = pn0 + offset, *qn1 = pn1 + offset, *qn2 = pn2 + offset;
+  const float *qa0 = pa0 + offset, *qa1 = pa1 + offset, *qa2 = pa2 + offset;
+  for (size_t x = x0; x < x1; ++x) {
+    const float dc0 = qc0[x] - pc0[x], dc1 = qc1[x] - pc1[x],
+                dc2 = qc2[x] - pc2[x];
+    const float dn0 = qn0[x] - pn0[x], dn1 = qn1[x] - pn1[x],
+                dn2 = qn2[x] - pn2[x];
+    const float da0 = qa0[x] - pa0[x], da1 = qa1[x] - pa1[x],
+                da2 = qa2[x] - pa2[x];
+    const float distance = (dc0 * dc0 + dc1 * dc1 + dc2 * dc2) * invColor +
+                           (dn0 * dn0 + dn1 * dn1 + dn2 * dn2) * invNormal +
+                           (da0 * da0 + da1 * da1 + da2 * da2) * invAlbedo;
+    const float weight = h * fastExp(-distance);
+    w[x] += weight;
+    s0[x] += weight * qc0[x];
+    s1[x] += weight * qc1[x];
+    s2[x] += weight * qc2[x];
+  }
+}
+
+void Denoiser::operator()(size_t width, size_t height, size_t samples,
+                          const Accumulator &accumulation,
+                          const AovBuffers &aovs, vector<float3> &out) const {
+  const size_t size = width * height;
+  const float mean = 1.0f / float(samples);
+  const bool useNormal = !aovs.normal(0).empty();
+  const bool useAlbedo = !aovs.albedo(0).empty();
+
+  // Planar working copies of the per-sample means.
+  vector<float> color[3], next[3], normal[3], albedo[3];
+  for (int k = 0; k < 3; ++k) {
+    color[k].resize(size);
+    next[k].resize(size);
+    normal[k].assign(size, 0.0f);
+    albedo[k].assign(size, 1.0f);
+    if (useNormal) {
+      for (size_t i = 0; i < size; ++i) {
+        normal[k][i] = aovs.normal(k)[i] * mean;
+      }
+    }
+    if (useAlbedo) {
+      for (size_t i = 0; i < size; ++i) {
+        albedo[k][i] = aovs.albedo(k)[i] * mean;
+      }
+    }
+  }
+  const float epsilon = 1e-3f;
+  for (size_t i = 0; i < size; ++i) {
+    const double3 value = accumulation.sum(i) * double(mean);
+    for (int k = 0; k < 3; ++k) {
+      color[k][i] = float(value[k]) / std::max(albedo[k][i], epsilon);
+    }
+  }
+
+  const float kernel[] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f,
+                          1.0f / 16.0f};
+  const float invNormal =
+      useNormal ? 1.0f / (sigmaNormal * sigmaNormal) : 0.0f;
+  const float invAlbedo =
+      useAlbedo ? 1.0f / (sigmaAlbedo * sigmaAlbedo) : 0.0f;
+
+  for (int iteration = 0; iteration < iterations; ++iteration) {
+    const int step = 1 << iteration;
+    const float sigma = sigmaColor / float(step);
+    const float invColor = 1.0f / (sigma * sigma);
+    parallelRows(height, [&](size_t y0, size_t y1) {
+      vector<float> weights(width), sums[3];
+      for (int k = 0; k < 3; ++k) {
+        sums[k].resize(width);
+      }
+      for (size_t y = y0; y < y1; ++y) {
+        std::fill(weights.begin(), weights.end(), 0.0f);
+        for (int k = 0; k < 3; ++k) {
+          std::fill(sums[k].begin(), sums[k].end(), 0.0f);
+        }
+        const size_t row = y * width;
+        for (int j = 0; j < 5; ++j) {
+          const long qy = long(y) + (j - 2) * step;
+          if (qy < 0 || qy >= long(height)) {
+            continue;
+          }
+          for (int i = 0; i < 5; ++i) {
+            const long dx = (i - 2) * step;
+            const size_t x0 = size_t(std::max(0L, -dx));
+            const size_t x1 =
+                size_t(std::max(0L, long(width) - std::max(0L, dx)));
+            const float h = kernel[i] * kernel[j];
+            const long offset = (qy - long(y)) * long(width) + dx;
+            const Planes p = {
+                {color[0].data() + row, color[1].data() + row,
+                 color[2].data() + row},
+                {normal[0].data() + row, normal[1].data() + row,
+                 normal[2].data() + row},
+                {albedo[0].data() + row, albedo[1].data() + row,
+                 albedo[2].data() + row}};
+            atrousTap(p, offset, x0, x1, h, invColor, invNormal, invAlbedo,
+                      weights.data(), sums[0].data(), sums[1].data(),
+                      sums[2].data());
+          }
+        }
+        for (int k = 0; k < 3; ++k) {
+          for (size_t x = 0; x < width; ++x) {
+            next[k][row + x] = sums[k][x] / weights[x];
+          }
+        }
+      }
+    });
+    for (int k = 0; k < 3; ++k) {
+      std::swap(color[k], next[k]);
+    }
+  }
+
+  out.resize(size);
+  for (size_t i = 0; i < size; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      out[i][k] = color[k][i] * std::max(albedo[k][i], epsilon);
+    }
+  }
+}
+} // namespace iq
+
+// PNG encoder that filters and deflates independent blocks of rows in
+// parallel. Every block ends on a byte boundary with an empty stored block
+// (a zlib sync flush), so the blocks concatenate into one valid stream and
+// only the Adler-32 checksums have to be combined. Level 0 writes stored
+// blocks, higher levels use fixed Huffman codes with a hash chain search
+// whose depth grows with the level.
+namespace iq {
+namespace png {
+
+struct BitWriter {
+  vector<uint8_t> &out;
+  uint64_t buffer = 0;
+  int count = 0;
+  explicit BitWriter(vector<uint8_t> &out) : out(out) {}
+  void add(uint32_t bits, int length) {
+    buffer |= uint64_t(bits) << count;
+    count += length;
+    while (count >= 8) {
+      out.push_back(uint8_t(buffer));
+      buffer >>= 8;
+      count -= 8;
+    }
+  }
+  // Huffman codes are packed starting with their most significant bit.
+  void code(uint32_t bits, int length) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; ++i) {
+      reversed = (reversed << 1) | ((bits >> i) & 1);
+    }
+    add(reversed, length);
+  }
+  void align() {
+    if (count > 0) {
+      add(0, 8 - count);
+    }
+  }
+};
+
+inline void literal(BitWriter &bits, int symbol) {
+  if (symbol <= 143) {
+    bits.code(0x30 + symbol, 8);
+  } else if (symbol <= 255) {
+    bits.code(0x190 + symbol - 144, 9);
+  } else if (symbol <= 279) {
+    bits.code(symbol - 256, 7);
+  } else {
+    bits.code(0xc0 + symbol - 280, 8);
+  }
+}
+
+void match(BitWriter &bits, int length, int distance) {
+  static const uint16_t lengthBase[] = {
+      3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+      31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+  static const uint8_t lengthExtra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                        1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                        4, 4, 4, 4, 5, 5, 5, 5, 0};
+  static const uint16_t distanceBase[] = {
+      1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+      33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+      1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+  static const uint8_t distanceExtra[] = {0, 0, 0,  0,  1,  1,  2,  2,
+                                          3, 3, 4,  4,  5,  5,  6,  6,
+                                          7, 7, 8,  8,  9,  9,  10, 10,
+                                          11, 11, 12, 12, 13, 13};
+  int l = 28;
+  while (lengthBase[l] > length) {
+    --l;
+  }
+  literal(bits, 257 + l);
+  bits.add(length - lengthBase[l], lengthExtra[l]);
+  int d = 29;
+  while (distanceBase[d] > distance) {
+    --d;
+  }
+  bits.code(d, 5);
+  bits.add(distance - distanceBase[d], distanceExtra[d]);
+}
+
+// Raw deflate data for one block, ending byte aligned and never final.
+void deflate(const uint8_t *data, size_t size, int level,
+             vector<uint8_t> &out) {
+  if (level <= 0) {
+    for (size_t first = 0; first < size; first += 65535) {
+      const uint16_t length = uint16_t(std::min<size_t>(65535, size - first));
+      out.push_back(0);
+      out.push_back(uint8_t(length));
+      out.push_back(uint8_t(length >> 8));
+      out.push_back(uint8_t(~length));
+      out.push_back(uint8_t(~length >> 8));
+      out.insert(out.end(), data + first, data + first + length);
+    }
+    return;
+  }
+
+  const int window = 32768;
+  const int chain = level * 2;
+  const int hashBits = 15;
+  vector<int32_t> head(size_t(1) << hashBits, -1);
+  vector<int32_t> previous(window, -1);
+  auto hash = [&](size_t i) {
+    const uint32_t v = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16);
+    return (v * 2654435761u) >> (32 - hashBits);
+  };
+  auto insert = [&](size_t i) {
+    const uint32_t h = hash(i);
+    previous[i % window] = head[h];
+    head[h] = int32_t(i);
+  };
+
+  BitWriter bits(out);
+  bits.add(0, 1); // not final
+  bits.add(1, 2); // fixed Huffman codes
+  size_t i = 0;
+  while (i + 3 <= size) {
+    int best = 0;
+    int distance = 0;
+    int candidate = head[hash(i)];
+    const size_t limit = std::min<size_t>(258, size - i);
+    for (int n = 0; n < chain && candidate >= 0 &&
+                    i - size_t(candidate) <= size_t(window);
+         ++n) {
+      size_t length = 0;
+      while (length < limit && data[candidate + length] == data[i + length]) {
+        ++length;
+      }
+      if (int(length) > best) {
+        best = int(length);
+        distance = int(i - candidate);
+        if (length == limit) {
+          break;
+        }
+      }
+      candidate = previous[candidate % window];
+    }
+    if (best >= 3) {
+      match(bits, best, distance);
+      for (const size_t next = i + best; i < next; ++i) {
+        if (i + 3 <= size) {
+          insert(i);
+        }
+      }
+    } else {
+      insert(i);
+      literal(bits, data[i++]);
+    }
+  }
+  for (; i < size; ++i) {
+    literal(bits, data[i]);
+  }
+  literal(bits, 256);
+
+  // Sync flush: an empty stored block re-aligns to a byte boundary.
+  bits.add(0, 3);
+  bits.align();
+  out.insert(out.end(), {0x00, 0x00, 0xff, 0xff});
+}
+
+inline uint32_t adler32(const uint8_t *data, size_t size) {
+  uint32_t s1 = 1, s2 = 0;
+  while (size > 0) {
+    const size_t n = std::min<size_t>(size, 5552);
+    for (size_t i = 0; i < n; ++i) {
+      s1 += data[i];
+      s2 += s1;
+    }
+    s1 %= 65521;
+    s2 %= 65521;
+    data += n;
+    size -= n;
+  }
+  return (s2 << 16) | s1;
+}
+
+// Checksum of the concatenation of two buffers, after zlib's
+// adler32_combine.
+inline uint32_t adler32Combine(uint32_t a, uint32_t b, size_t sizeB) {
+  const uint32_t base = 65521;
+  const uint32_t remainder = uint32_t(sizeB % base);
+  uint32_t s1 = a & 0xffff;
+  uint32_t s2 = uint32_t((uint64_t(remainder) * s1) % base);
+  s1 += (b & 0xffff) + base - 1;
+  s2 += (a >> 16) + (b >> 16) + base - remainder;
+  if (s1 >= base) {
+    s1 -= base;
+  }
+  if (s1 >= base) {
+    s1 -= base;
+  }
+  if (s2 >= 2 * base) {
+    s2 -= 2 * base;
+  }
+  if (s2 >= base) {
+    s2 -= base;
+  }
+  return (s2 << 16) | s1;
+}
+
+inline uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size) {
+  static const auto table = []() {
+    std::array<uint32_t, 256> t;
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k) {
+        c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      }
+      t[n] = c;
+    }
+    return t;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// Picks the PNG filter with the smallest sum of absolute residuals per row.
+void filterRow(const uint8_t *row, const uint8_t *above, size_t stride,
+               uint8_t *out, vector<uint8_t> &scratch) {
+  const int n = 3;
+  scratch.resize(stride);
+  uint64_t bestCost = ~uint64_t(0);
+  for (int filter = 0; filter < 5; ++filter) {
+    uint64_t cost = 0;
+    for (size_t i = 0; i < stride; ++i) {
+      const int a = i >= n ? row[i - n] : 0;
+      const int b = above != nullptr ? above[i] : 0;
+      const int c = i >= n && above != nullptr ? above[i - n] : 0;
+      int predicted = 0;
+      switch (filter) {
+      case 1:
+        predicted = a;
+        break;
+      case 2:
+        predicted = b;
+        break;
+      case 3:
+        predicted = (a + b) >> 1;
+        break;
+      case 4: {
+        const int p = a + b - c;
+        const int pa = std::abs(p - a), pb = std::abs(p - b),
+                  pc = std::abs(p - c);
+        predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+        break;
+      }
+      }
+      scratch[i] = uint8_t(row[i] - predicted);
+      cost += std::abs(int(int8_t(scratch[i])));
+    }
+    if (cost < bestCost) {
+      bestCost = cost;
+      out[0] = uint8_t(filter);
+      std::memcpy(out + 1, scratch.data(), stride);
+    }
+  }
+}
+
+bool write(const string &filename, size_t width, size_t height,
+           const vector<byte3> &pixels, int level) {
+  const size_t stride = width * 3;
+  const uint8_t *image = &pixels[0][0];
+
+  // Blocks of whole rows, at least 64 KiB of filtered data each.
+  const size_t threads = iq::numa::workerCount();
+  const size_t minimumRows = std::max<size_t>(1, 65536 / (stride + 1));
+  const size_t rows = std::max(minimumRows, (height + threads - 1) / threads);
+  const size_t blocks = (height + rows - 1) / rows;
+
+  vector<vector<uint8_t>> deflated(blocks);
+  vector<uint32_t> adler(blocks);
+  parallelRows(blocks, [&](size_t b0, size_t b1) {
+    vector<uint8_t> filtered, scratch;
+    for (size_t b = b0; b < b1; ++b) {
+      const size_t y0 = b * rows;
+      const size_t y1 = std::min(height, y0 + rows);
+      filtered.resize((y1 - y0) * (stride + 1));
+      for (size_t y = y0; y < y1; ++y) {
+        uint8_t *out = &filtered[(y - y0) * (stride + 1)];
+        if (level <= 0) {
+          // Stored data does not benefit from filtering.
+          out[0] = 0;
+          std::memcpy(out + 1, image + y * stride, stride);
+          continue;
+        }
+        const uint8_t *above = y > 0 ? image + (y - 1) * stride : nullptr;
+        filterRow(image + y * stride, above, stride, out, scratch);
+      }
+      deflate(filtered.data(), filtered.size(), level, deflated[b]);
+      adler[b] = adler32(filtered.data(), filtered.size());
+    }
+  });
+
+  vector<uint8_t> idat = {0x78, 0x01};
+  uint32_t checksum = 1;
+  for (size_t b = 0; b < blocks; ++b) {
+    idat.insert(idat.end(), deflated[b].begin(), deflated[b].end());
+    const size_t y0 = b * rows;
+    const size_t y1 = std::min(height, y0 + rows);
+    checksum = adler32Combine(checksum, adler[b], (y1 - y0) * (stride + 1));
+  }
+  // Final empty block with fixed codes, then the zlib trailer.
+  idat.insert(idat.end(), {0x03, 0x00});
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    idat.push_back(uint8_t(checksum >> shift));
+  }
+
+  std::ofstream file(filename, std::ios::binary);
+  auto chunk = [&](const char *type, const uint8_t *data, size_t size) {
+    const uint8_t length[] = {uint8_t(size >> 24), uint8_t(size >> 16),
+                              uint8_t(size >> 8), uint8_t(size)};
+    file.write(reinterpret_cast<const char *>(length), 4);
+    file.write(type, 4);
+    file.write(reinterpret_cast<const char *>(data), size);
+    uint32_t crc = crc32(0, reinterpret_cast<const uint8_t *>(type), 4);
+    crc = crc32(crc, data, size);
+    const uint8_t trailer[] = {uint8_t(crc >> 24), uint8_t(crc >> 16),
+                               uint8_t(crc >> 8), uint8_t(crc)};
+    file.write(reinterpret_cast<const char *>(trailer), 4);
+  };
+  const uint8_t header[] = {uint8_t(width >> 24),  uint8_t(width >> 16),
+                            uint8_t(width >> 8),   uint8_t(width),
+                            uint8_t(height >> 24), uint8_t(height >> 16),
+                            uint8_t(height >> 8),  uint8_t(height),
+                            8, 2, 0, 0, 0};
+  file.write("\x89PNG\r\n\x1a\n", 8);
+  chunk("IHDR", header, sizeof(header));
+  chunk("IDAT", idat.data(), idat.size());
+  chunk("IEND", nullptr, 0);
+  return bool(file);
+}
+
+} // namespace png
+} // namespace iq
+
+// Fills world with one of the built-in scenes, returns false for an
+// unknown name. All scenes share the camera set up in main().
+// textureFile optionally replaces the pattern on the textured scene's
+// center sphere with a .pfm image.
+bool buildScene(const string &name, World &world, const string &textureFile) {
+  using namespace iq::texture;
+  vector<Material *> materials;
+  // Spheres added after the five all scenes share.
+  vector<Sphere> extra;
+  size_t lights = 0;
+  size_t movers = 0;
+  bool dark = false;
+  if (name == "spheres") {
+    materials = {world.create<Lambertian>(float3(0.75f, 0.75f, 0.75f)),
+                 world.create<Lambertian>(float3(0.8f, 0.8f, 0.9f)),
+                 world.create<Lambertian>(float3(0.0f, 1.0f, 0.0f)),
+                 world.create<Lambertian>(float3(1.0f, 0.0f, 0.0f)),
+                 world.create<Lambertian>(float3(1.0f, 1.0f, 1.0f))};
+  } else if (name == "materials") {
+    // Rough gold, mirror and glass next to the diffuse spheres.
+    materials = {world.create<Lambertian>(float3(0.75f, 0.75f, 0.75f)),
+                 world.create<Conductor>(float3(1.0f, 0.78f, 0.34f), 0.4f),
+                 world.create<Lambertian>(float3(0.0f, 1.0f, 0.0f)),
+                 world.create<Conductor>(float3(0.95f, 0.93f, 0.88f), 0.0f),
+                 world.create<Dielectric>(1.5f)};
+  } else if (name == "textured") {
+    // A polar checker of 64k x 64k texels, 48 GB if it were resident, on
+    // the ground and a striped or loaded image on the center sphere.
+    const auto checker = [](float u, float v) {
+      const bool odd = (int(u * 256.0f) + int(v * 2048.0f)) & 1;
+      return odd ? float3(0.9f) : float3(0.15f);
+    };
+    std::unique_ptr<Source> image;
+    if (!textureFile.empty()) {
+      if (!(image = PfmFile::open(textureFile))) {
+        std::cerr << "cannot read " << textureFile << std::endl;
+        return false;
+      }
+    } else {
+      image = std::make_unique<Procedural>(
+          2048, 1024, [](float u, float v) {
+            const float stripe = 0.5f + 0.5f * std::sin(u * 64.0f * iq::pi);
+            return float3(stripe, 0.3f + 0.7f * v, 1.0f - stripe);
+          });
+    }
+    const Texture *ground = world.create<Texture>(
+        std::make_unique<Procedural>(65536, 65536, checker));
+    const Texture *center = world.create<Texture>(std::move(image));
+    materials = {world.create<Lambertian>(float3(1.0f), ground),
+                 world.create<Lambertian>(float3(0.8f, 0.8f, 0.9f)),
+                 world.create<Lambertian>(float3(1.0f), center),
+                 world.create<Lambertian>(float3(1.0f, 0.0f, 0.0f)),
+                 world.create<Lambertian>(float3(1.0f, 1.0f, 1.0f))};
+  } else if (name == "lights") {
+    // The diffuse spheres at night among many small colored lights.
+    materials = {world.create<Lambertian>(float3(0.75f, 0.75f, 0.75f)),
+                 world.create<Lambertian>(float3(0.8f, 0.8f, 0.9f)),
+                 world.create<Lambertian>(float3(0.0f, 1.0f, 0.0f)),
+                 world.create<Lambertian>(float3(1.0f, 0.0f, 0.0f)),
+                 world.create<Lambertian>(float3(1.0f, 1.0f, 1.0f))};
+    lights = 1000;
+    dark = true;
+  } else if (name == "volumes") {
+    // A cloud, a dense scattering ball and the diffuse spheres in thin fog.
+    const Medium *fog =
+        world.create<HomogeneousMedium>(0.15f, float3(0.9f), 0.0f);
+    const Medium *wax = world.create<HomogeneousMedium>(
+        20.0f, float3(0.95f, 0.55f, 0.4f), 0.0f);
+    const Medium *cloud = world.create<GridMedium>(
+        float3(-1.0f, 0.0f, -1.0f), 0.5f, 64, 30.0f,
+        [](const float3 &p) {
+          const float noise =
+              std::sin(5.0f * p.x + 1.3f) * std::sin(5.0f * p.y + 0.7f) *
+                  std::sin(5.0f * p.z + 2.1f) +
+              0.5f * std::sin(11.0f * p.x + 0.4f) *
+                  std::sin(13.0f * p.y + 2.5f) * std::sin(12.0f * p.z);
+          return 2.0f * (1.0f - length(p)) * (0.6f + 0.6f * noise);
+        },
+        float3(0.95f), 0.3f);
+    materials = {world.create<Lambertian>(float3(0.75f, 0.75f, 0.75f)),
+                 world.create<MediumBoundary>(wax, fog),
+                 world.create<Lambertian>(float3(0.0f, 1.0f, 0.0f)),
+                 world.create<MediumBoundary>(cloud, fog),
+                 world.create<Lambertian>(float3(1.0f, 1.0f, 1.0f)),
+                 world.create<MediumBoundary>(fog)};
+    // Fog around the spheres, but not the camera.
+    extra = {Sphere(float3(0.0f, -0.2f, -1.0f), 2.0f, materials[5])};
+  } else if (name == "caustics") {
+    // Glass spheres and a mirror in a closed diffuse room lit by one small
+    // lamp, so that much of the floor is lit through the glass.
+    materials = {world.create<Lambertian>(float3(0.75f, 0.75f, 0.75f)),
+                 world.create<Dielectric>(1.5f),
+                 world.create<Lambertian>(float3(0.0f, 1.0f, 0.0f)),
+                 world.create<Conductor>(float3(0.95f, 0.93f, 0.88f), 0.0f),
+                 world.create<Dielectric>(1.5f, float3(1.0f, 0.9f, 0.6f)),
+                 world.create<Lambertian>(float3(0.7f, 0.7f, 0.7f)),
+                 world.create<DiffuseLight>(float3(2000.0f))};
+    extra = {Sphere(float3(0.0f, 0.0f, -1.0f), 6.0f, materials[5]),
+             Sphere(float3(0.3f, 2.5f, -0.8f), 0.05f, materials[6])};
+    dark = true;
+  } else if (name == "motion") {
+    // The diffuse spheres among small ones moving while the shutter is open.
+    materials = {world.create<Lambertian>(float3(0.75f, 0.75f, 0.75f)),
+                 world.create<Lambertian>(float3(0.8f, 0.8f, 0.9f)),
+                 world.create<Lambertian>(float3(0.0f, 1.0f, 0.0f)),
+                 world.create<Lambertian>(float3(1.0f, 0.0f, 0.0f)),
+                 world.create<Lambertian>(float3(1.0f, 1.0f, 1.0f))};
+    movers = 2000;
+  } else if (name == "indoor") {
+    // The diffuse spheres in a closed room whose lamp is shaded from below,
+    // so that everything but the ceiling is lit indirectly.
+    materials = {world.create<Lambertian>(float3(0.75f, 0.75f, 0.75f)),
+                 world.create<Lambertian>(float3(0.8f, 0.8f, 0.9f)),
+                 world.create<Lambertian>(float3(0.0f, 1.0f, 0.0f)),
+                 world.create<Lambertian>(float3(1.0f, 0.0f, 0.0f)),
+                 world.create<Lambertian>(float3(1.0f, 1.0f, 1.0f)),
+                 world.create<Lambertian>(float3(0.8f, 0.8f, 0.8f)),
+                 world.create<DiffuseLight>(float3(500.0f))};
+    extra = {Sphere(float3(0.0f, 0.0f, -1.0f), 6.0f, materials[5]),
+             Sphere(float3(0.0f, 4.6f, -1.0f), 0.7f, materials[5]),
+             Sphere(float3(0.0f, 5.5f, -1.0f), 0.1f, materials[6])};
+    dark = true;
+  } else {
+    return false;
+  }
+  for (size_t i = 0; i < materials.size(); ++i) {
+    materials[i]->setId(uint32_t(i + 1));
+  }
+  world.setEnvironment(world.create<Environment>(
+      dark ? Procedural(1, 1, [](float, float) { return float3(0.0f); })
+                 : Environment::gradient()));
+
+  world.reserve(5 + extra.size() + lights + movers);
+  world.add(Sphere(float3(0.0f, -100.5f, -1.0f), 100.0f, materials[0]));
+  world.add(Sphere(float3(1.0f, 0.0f, -1.0f), 0.5f, materials[1]));
+  world.add(Sphere(float3(0.0f, 0.0f, -1.0f), 0.5f, materials[2]));
+  world.add(Sphere(float3(-1.0f, 0.0f, -1.0f), 0.5f, materials[3]));
+  world.add(Sphere(float3(0.0f, 0.0f, 0.0f), 0.5f, materials[4]));
+  for (const Sphere &sphere : extra) {
+    world.add(sphere);
+  }
+
+  std::mt19937 engine(7);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  // Random small spheres around the shared ones, clear of all others.
+  const auto scatter = [&](float minRadius, float maxRadius, float3 &center,
+                           float &radius) {
+    center = float3(-3.0f + 6.0f * uniform(engine),
+                    -0.45f + 1.5f * uniform(engine),
+                    -4.0f + 5.5f * uniform(engine));
+    radius = minRadius + (maxRadius - minRadius) * uniform(engine);
+    bool free = true;
+    for (size_t i = 1; i < world.size(); ++i) {
+      const Sphere &other = world.sphere(uint32_t(i));
+      free = free &&
+             length(center - other.m_pos) > other.m_radius + radius + 0.01f;
+    }
+    return free;
+  };
+  const auto hue = [&]() {
+    const float h = 6.0f * uniform(engine);
+    return clamp(float3(std::abs(h - 3.0f) - 1.0f, 2.0f - std::abs(h - 2.0f),
+                        2.0f - std::abs(h - 4.0f)),
+                 0.0f, 1.0f);
+  };
+  float3 center;
+  float radius;
+  while (lights > 0) {
+    if (!scatter(0.005f, 0.015f, center, radius)) {
+      continue;
+    }
+    const float3 color = hue();
+    world.add(Sphere(center, radius,
+                     world.create<DiffuseLight>(100.0f * (color + 0.25f))));
+    --lights;
+  }
+  while (movers > 0) {
+    if (!scatter(0.02f, 0.05f, center, radius)) {
+      continue;
+    }
+    const float3 color = hue();
+    const float3 motion(uniform(engine), uniform(engine), uniform(engine));
+    world.add(Sphere(center, center + 0.6f * (motion - 0.5f), radius,
+                     world.create<Lambertian>(0.2f + 0.7f * color)));
+    --movers;
+  }
+  world.build();
+  return true;
+}
+
+// Tests include this file for its types and bring their own main().
+#ifndef IQ_NO_MAIN
+int main(int argc, char **argv) {
+  const size_t width = 800;
+  const size_t height = 600;
+  size_t samples = 8;
+
+  const char *usage = " [options]\n"
+                      "  --scene <name>             spheres, materials,\n"
+                      "                             textured, lights,\n"
+                      "                             volumes, caustics,\n"
+                      "                             indoor, motion\n"
+                      "  --texture <file>           .pfm for textured scene\n"
+                      "  --texture-cache <MB>       texture tile budget\n"
+                      "  --envmap <file>            .pfm lat-long lighting\n"
+                      "  --samples <n>              samples per pixel\n"
+                      "  --integrator <path|photon>\n"
+                      "  --photons <n>              photons per pass\n"
+                      "  --photon-radius <r>        initial gather radius\n"
+                      "  --guiding <passes>         learn a path guide\n"
+                      "  --radiance-cache           cache diffuse bounces\n"
+                      "  --aperture <d>             lens diameter, 0 pinhole\n"
+                      "  --focus <dist|auto>        distance in focus\n"
+                      "  --blades <n>               polygonal aperture\n"
+                      "  --reference <file>         .pfm for per-pass RMSE\n"
+                      "  --preview                  publish passes to iqview\n"
+                      "  --linear <file>            write .exr, .pfm or .hdr\n"
+                      "  --tonemap <gamma|srgb|aces>\n"
+                      "  --exposure <stops>\n"
+                      "  --snapshot-level <0-9>     PNG level between passes\n"
+                      "  --aovs                     write iq.<aov>.pfm\n"
+                      "  --denoise                  a-trous filter output\n"
+                      "  --stats <file>             write counters as JSON\n"
+                      "  --trace <file>             write a Chrome trace\n"
+                      "  --heatmap <file>           per-pixel cost .png/.pfm\n"
+                      "  --replicate-scene          one scene copy per node\n";
+
+  bool preview = false;
+  string linearOutput;
+  iq::Display display;
+  // Intermediate snapshots favour speed, the final image uses the stb level.
+  int snapshotLevel = 0;
+  bool writeAovs = false;
+  bool denoise = false;
+  string statsOutput;
+  string traceOutput;
+  string heatmapOutput;
+  bool replicateScene = false;
+  string sceneName = "spheres";
+  string textureFile;
+  string environmentFile;
+  bool photonMapping = false;
+  size_t photonCount = 200000;
+  float photonRadius = 0.05f;
+  string referenceFile;
+  size_t guidingPasses = 0;
+  bool radianceCache = false;
+  float aperture = 0.0f;
+  float focus = 0.0f; // automatic
+  int blades = 0;
+  for (int i = 1; i < argc; ++i) {
+    const string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (arg == "--samples" && hasValue) {
+      samples = std::stoul(argv[++i]);
+      if (samples == 0) {
+        std::cerr << "usage: " << argv[0] << usage;
+        return 1;
+      }
+    } else if (arg == "--preview") {
+      preview = true;
+    } else if (arg == "--linear" && hasValue) {
+      linearOutput = argv[++i];
+    } else if (arg == "--tonemap" && hasValue) {
+      const string mode = argv[++i];
+      if (mode == "gamma") {
+        display.tonemap = iq::Tonemap::Gamma;
+      } else if (mode == "srgb") {
+        display.tonemap = iq::Tonemap::Srgb;
+      } else if (mode == "aces") {
+        display.tonemap = iq::Tonemap::Aces;
+      } else {
+        std::cerr << "usage: " << argv[0] << usage;
+        return 1;
+      }
+    } else if (arg == "--exposure" && hasValue) {
+      display.exposure = std::stof(argv[++i]);
+    } else if (arg == "--snapshot-level" && hasValue) {
+      snapshotLevel = std::stoi(argv[++i]);
+    } else if (arg == "--aovs") {
+      writeAovs = true;
+    } else if (arg == "--denoise") {
+      denoise = true;
+    } else if (arg == "--stats" && hasValue) {
+      if (!iq::stats::enabled) {
+        std::cerr << "--stats requires a build with -DIQ_STATS=1" << std::endl;
+        return 1;
+      }
+      statsOutput = argv[++i];
+    } else if (arg == "--trace" && hasValue) {
+      traceOutput = argv[++i];
+    } else if (arg == "--heatmap" && hasValue) {
+      heatmapOutput = argv[++i];
+    } else if (arg == "--scene" && hasValue) {
+      sceneName = argv[++i];
+    } else if (arg == "--texture" && hasValue) {
+      textureFile = argv[++i];
+    } else if (arg == "--texture-cache" && hasValue) {
+      iq::texture::cache().setBudget(size_t(std::stoul(argv[++i])) << 20);
+    } else if (arg == "--envmap" && hasValue) {
+      environmentFile = argv[++i];
+    } else if (arg == "--replicate-scene") {
+      replicateScene = true;
+    } else if (arg == "--integrator" && hasValue) {
+      const string integrator = argv[++i];
+      if (integrator != "path" && integrator != "photon") {
+        std::cerr << "usage: " << argv[0] << usage;
+        return 1;
+      }
+      photonMapping = integrator == "photon";
+    } else if (arg == "--photons" && hasValue) {
+      photonCount = std::stoul(argv[++i]);
+    } else if (arg == "--photon-radius" && hasValue) {
+      photonRadius = std::stof(argv[++i]);
+    } else if (arg == "--reference" && hasValue) {
+      referenceFile = argv[++i];
+    } else if (arg == "--guiding" && hasValue) {
+      guidingPasses = std::stoul(argv[++i]);
+    } else if (arg == "--radiance-cache") {
+      radianceCache = true;
+    } else if (arg == "--aperture" && hasValue) {
+      aperture = std::stof(argv[++i]);
+    } else if (arg == "--focus" && hasValue) {
+      const string distance = argv[++i];
+      focus = distance == "auto" ? 0.0f : std::stof(distance);
+    } else if (arg == "--blades" && hasValue) {
+      blades = std::stoi(argv[++i]);
+    } else {
+      std::cerr << "usage: " << argv[0] << usage;
+      return 1;
+    }
+  }
+
+  if (!traceOutput.empty()) {
+    iq::trace::enable();
+  }
+
+  const iq::numa::Placement &placement = iq::numa::placement();
+  std::cout << "Workers " << placement.slots.size() << " on "
+            << placement.nodes() << " NUMA node(s)";
+  for (size_t node = 0; node < placement.nodes(); ++node) {
+    std::cout << (node == 0 ? ": " : ", ") << "node " << node;
+    if (!placement.cpus[node].empty()) {
+      std::cout << " cpus " << iq::numa::formatCpuList(placement.cpus[node]);
+    }
+  }
+  std::cout << (placement.slots[0].cpu >= 0 ? " (pinned)" : " (unpinned)")
+            << std::endl;
+
+  vector<byte3> pixels(width * height);
+  Accumulator accumulation(width * height);
+  vector<float3> filtered;
+  std::unique_ptr<AovBuffers> aovs;
+  if (writeAovs || denoise) {
+    aovs = std::make_unique<AovBuffers>(width * height);
+  }
+  vector<float> cost;
+  if (!heatmapOutput.empty()) {
+    cost.resize(width * height);
+  }
+  iq::TileScheduler scheduler(width, height);
+  if (preview) {
+    scheduler.setOrder(iq::TileScheduler::Order::CenterFirst);
+  }
+  // First touch of the accumulation by the node that renders each tile.
+  scheduler.run(
+      [&](const iq::TileScheduler::Tile &tile, size_t) {
+        for (size_t y = tile.y0; y < tile.y1; ++y) {
+          accumulation.clear(tile.x0 + y * width, tile.x1 + y * width);
+        }
+      },
+      false);
+  scheduler.reset();
+
+  float3 eye(0.0f, 2.0f, 3.0f);
+  float3 at(0.0f, 0.0f, 0.0f);
+  const float3 up(0.0f, -1.0f, 0.0f);
+
+  const float aspect = float(width) / float(height);
+  const float fov = 40.0f;
+
+  iq::trace::Zone sceneZone("scene");
+  World world;
+  if (!buildScene(sceneName, world, textureFile)) {
+    std::cerr << "usage: " << argv[0] << usage;
+    return 1;
+  }
+
+  // Without a focus distance the camera focuses on the center of the image.
+  const auto makeCamera = [&]() {
+    return Camera(eye, at, up, fov, aspect, aperture,
+                  focus > 0.0f ? focus : autofocus(world, eye, at), blades);
+  };
+  Camera camera = makeCamera();
+  if (!environmentFile.empty()) {
+    const auto image = iq::texture::PfmFile::open(environmentFile);
+    if (!image) {
+      std::cerr << "cannot read " << environmentFile << std::endl;
+      return 1;
+    }
+    world.setEnvironment(world.create<Environment>(*image));
+  }
+  // 16k voxels of 0.5 units take 16 MB.
+  std::unique_ptr<iq::PathGuide> guide;
+  if (guidingPasses > 0) {
+    guide = std::make_unique<iq::PathGuide>(1 << 14, 0.5f);
+  }
+  // 256k voxels of 0.05 units take 6 MB.
+  std::unique_ptr<iq::RadianceCache> cache;
+  if (radianceCache) {
+    cache = std::make_unique<iq::RadianceCache>(1 << 18, 0.05f);
+  }
+  vector<float3> reference;
+  if (!referenceFile.empty()) {
+    const auto image = iq::texture::PfmFile::open(referenceFile);
+    if (!image || image->width() != width || image->height() != height) {
+      std::cerr << "cannot read " << width << "x" << height << " "
+                << referenceFile << std::endl;
+      return 1;
+    }
+    reference.resize(width * height);
+    image->read(0, 0, width, height, reference.data());
+  }
+
+  // Read-only scene data is optionally copied onto every node.
+  vector<std::unique_ptr<World>> replicas;
+  vector<const World *> worlds(placement.nodes(), &world);
+  if (replicateScene && placement.nodes() > 1) {
+    replicas.resize(placement.nodes());
+    vector<thread> threads;
+    for (size_t node = 0; node < placement.nodes(); ++node) {
+      threads.emplace_back([&, node]() {
+        for (size_t i = 0; i < placement.slots.size(); ++i) {
+          if (placement.slots[i].node == int(node)) {
+            iq::numa::enter(i);
+            break;
+          }
+        }
+        replicas[node] = std::make_unique<World>(world.clone());
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    for (size_t node = 0; node < placement.nodes(); ++node) {
+      worlds[node] = replicas[node].get();
+    }
+  }
+  sceneZone.end();
+
+  auto start = chrono::steady_clock::now();
+
+#ifdef IQ_PREVIEW
+  // In preview mode passes are published to iqview instead of being written
+  // to disk, and rendering continues until the viewer asks to stop.
+  iq::preview::Header *shared = nullptr;
+  size_t sharedSize = 0;
+  uint32_t cameraSequence = 0;
+  if (preview) {
+    shared = iq::preview::create(width, height, sharedSize);
+    if (shared == nullptr) {
+      std::cerr << "Failed to create preview segment" << std::endl;
+      return 1;
+    }
+    std::memcpy(shared->eye, &eye, sizeof(shared->eye));
+    std::memcpy(shared->at, &at, sizeof(shared->at));
+  }
+#else
+  if (preview) {
+    std::cerr << "Preview is not supported on this platform" << std::endl;
+    return 1;
+  }
+#endif
+
+  size_t s = 0;
+  while (preview || s < samples) {
+#ifdef IQ_PREVIEW
+    if (shared != nullptr) {
+      if (shared->stop.load(std::memory_order_acquire)) {
+        break;
+      }
+      const uint32_t sequence =
+          shared->cameraSequence.load(std::memory_order_acquire);
+      if (sequence != cameraSequence && (sequence & 1) == 0) {
+        float3 newEye, newAt;
+        std::memcpy(&newEye, shared->eye, sizeof(newEye));
+        std::memcpy(&newAt, shared->at, sizeof(newAt));
+        if (shared->cameraSequence.load(std::memory_order_acquire) ==
+            sequence) {
+          cameraSequence = sequence;
+          eye = newEye;
+          at = newAt;
+          camera = makeCamera();
+          accumulation.clear();
+          if (aovs) {
+            aovs->clear();
+          }
+          std::fill(cost.begin(), cost.end(), 0.0f);
+          scheduler.reset();
+          s = 0;
+        }
+      }
+    }
+#endif
+
+    iq::trace::Zone passZone("pass", int64_t(s));
+    std::unique_ptr<iq::PhotonGrid> photons;
+    if (photonMapping) {
+      iq::trace::Zone zone("photons", int64_t(s));
+      photons = std::make_unique<iq::PhotonGrid>(
+          tracePhotons(world, photonCount),
+          iq::photonRadius(photonRadius, s));
+    }
+    if (guide) {
+      guide->setLearning(s < guidingPasses);
+    }
+    renderPass(camera, worlds, width, height, scheduler, accumulation,
+               aovs.get(), cost.empty() ? nullptr : &cost, photons.get(),
+               Caches{guide.get(), cache.get()});
+    if (guide && guide->learning()) {
+      iq::trace::Zone zone("guide");
+      guide->update();
+    }
+    ++s;
+
+    // Time to quality: the error after every pass against the reference.
+    if (!reference.empty()) {
+      const auto elapsed = chrono::duration_cast<chrono::milliseconds>(
+          chrono::steady_clock::now() - start);
+      const double error = iq::rmse(
+          iq::accumulatedRows(accumulation, width, 1.0 / s), reference,
+          width, height);
+      std::cout << "Pass " << s << " " << elapsed.count() << " [ms] RMSE "
+                << error << std::endl;
+    }
+
+    // Snapshots between passes stay unfiltered unless they are previewed.
+    if (denoise && (preview || s == samples)) {
+      {
+        iq::trace::Zone zone("denoise");
+        iq::Denoiser()(width, height, s, accumulation, *aovs, filtered);
+      }
+      iq::trace::Zone zone("tonemap");
+      iq::tonemap(
+          display, width, height,
+          [&](size_t y, float *row) {
+            std::copy_n(&filtered[y * width][0], 3 * width, row);
+          },
+          pixels);
+    } else {
+      iq::trace::Zone zone("tonemap");
+      iq::tonemap(display, accumulation, width, height, s, pixels);
+    }
+
+#ifdef IQ_PREVIEW
+    if (shared != nullptr) {
+      const uint32_t back = 1 - shared->front.load(std::memory_order_relaxed);
+      std::memcpy(iq::preview::framebuffer(shared, back), pixels.data(),
+                  pixels.size() * sizeof(byte3));
+      shared->samples = uint32_t(s);
+      shared->front.store(back, std::memory_order_release);
+      shared->sequence.fetch_add(1, std::memory_order_release);
+      continue;
+    }
+#endif
+
+    const bool last = s == samples;
+    iq::trace::Zone zone("png");
+    iq::png::write("iq.png", width, height, pixels,
+                   last ? stbi_write_png_compression_level : snapshotLevel);
+  }
+
+#ifdef IQ_PREVIEW
+  if (shared != nullptr) {
+    iq::preview::release(shared, sharedSize);
+    iq::preview::unlink();
+    iq::trace::Zone zone("png");
+    iq::png::write("iq.png", width, height, pixels,
+                   stbi_write_png_compression_level);
+  }
+#endif
+
+  // The outputs below are averages over the passes, of which there are none
+  // if the preview was stopped before the first one finished.
+  if (s == 0) {
+    std::cerr << "No pass finished, AOV, heatmap and linear outputs skipped"
+              << std::endl;
+  } else {
+    iq::trace::Zone aovZone("aovs");
+    if (aovs && !aovs->write("iq", width, height, s)) {
+      std::cerr << "Failed to write AOVs" << std::endl;
+    }
+    aovZone.end();
+
+    if (!heatmapOutput.empty() &&
+        !iq::writeHeatmap(heatmapOutput, width, height, cost, s)) {
+      std::cerr << "Failed to write " << heatmapOutput << std::endl;
+    }
+
+    iq::trace::Zone linearZone("linear");
+    iq::RowSource rows = iq::accumulatedRows(accumulation, width, 1.0 / s);
+    // Filled only with --denoise.
+    if (!filtered.empty()) {
+      rows = [&](size_t y, float3 *row) {
+        std::copy_n(&filtered[y * width], width, row);
+      };
+    }
+    if (!linearOutput.empty() &&
+        !iq::writeLinear(linearOutput, width, height, rows)) {
+      std::cerr << "Failed to write " << linearOutput << std::endl;
+    }
+    linearZone.end();
+  }
+
+  auto end = chrono::steady_clock::now();
+  auto diff = end - start;
+
+  std::cout << "Elapsed "
+            << chrono::duration_cast<chrono::milliseconds>(diff).count()
+            << " [ms] " << (photonMapping ? "photon" : "path") << std::endl;
+
+  const iq::texture::Cache::Stats tiles = iq::texture::cache().stats();
+  if (tiles.hits + tiles.misses > 0) {
+    std::cout << "Texture tiles: " << tiles.hits << " hits, " << tiles.misses
+              << " misses, " << tiles.evictions << " evictions" << std::endl;
+  }
+
+  if constexpr (iq::stats::enabled) {
+    const iq::stats::Counters counters = iq::stats::merged();
+    const double seconds = chrono::duration<double>(diff).count();
+    iq::stats::print(std::cout, counters, seconds);
+    if (!statsOutput.empty() &&
+        !iq::stats::writeJson(statsOutput, counters, seconds)) {
+      std::cerr << "Failed to write " << statsOutput << std::endl;
+    }
+  }
+
+  if (!traceOutput.empty() && !iq::trace::write(traceOutput)) {
+    std::cerr << "Failed to write " << traceOutput << std::endl;
+  }
+
+  return 0;
+}
+#endif // IQ_NO_MAIN
@@ -0,0 +1,156 @@
+// numa.h - NUMA topology and worker thread placement
+//
+// Worker slots are laid out node by node, one per CPU the process may run
+// on. A worker calls enter(slot) to pin itself to the slot's CPU and to
+// remember its node, which lets callers pick node-local data. The topology
+// is read from /sys on Linux; elsewhere, or if that fails, there is a single
+// node and threads are left unpinned.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace iq {
+namespace numa {
+
+struct Slot {
+  int node;
+  int cpu; // -1 if the thread is not pinned
+};
+
+struct Placement {
+  std::vector<Slot> slots;
+  std::vector<std::vector<int>> cpus; // per node
+  size_t nodes() const { return cpus.size(); }
+};
+
+// Parses a sysfs cpu list such as "0-3,8-11".
+inline std::vector<int> parseCpuList(const std::string &list) {
+  std::vector<int> cpus;
+  std::stringstream stream(list);
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    const size_t dash = range.find('-');
+    try {
+      const int first = std::stoi(range.substr(0, dash));
+      const int last =
+          dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    } catch (const std::exception &) {
+      // Blank or malformed entry.
+    }
+  }
+  return cpus;
+}
+
+// Inverse of parseCpuList.
+inline std::string formatCpuList(const std::vector<int> &cpus) {
+  std::string list;
+  for (size_t i = 0; i < cpus.size();) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+      ++j;
+    }
+    list += (list.empty() ? "" : ",") + std::to_string(cpus[i]);
+    if (j > i) {
+      list += "-" + std::to_string(cpus[j]);
+    }
+    i = j + 1;
+  }
+  return list;
+}
+
+inline Placement detect() {
+  Placement placement;
+#ifdef __linux__
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string list;
+    if (online && std::getline(online, list)) {
+      for (int node : parseCpuList(list)) {
+        std::ifstream file("/sys/devices/system/node/node" +
+                           std::to_string(node) + "/cpulist");
+        std::string cpuList;
+        std::vector<int> cpus;
+        if (file && std::getline(file, cpuList)) {
+          for (int cpu : parseCpuList(cpuList)) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+              cpus.push_back(cpu);
+            }
+          }
+        }
+        if (!cpus.empty()) {
+          placement.cpus.push_back(cpus);
+        }
+      }
+    }
+    if (placement.cpus.empty()) {
+      std::vector<int> cpus;
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed)) {
+          cpus.push_back(cpu);
+        }
+      }
+      placement.cpus.push_back(cpus);
+    }
+  }
+#endif
+  for (size_t node = 0; node < placement.cpus.size(); ++node) {
+    for (int cpu : placement.cpus[node]) {
+      placement.slots.push_back({int(node), cpu});
+    }
+  }
+  if (placement.slots.empty()) {
+    const size_t threads =
+        std::max<size_t>(1, std::thread::hardware_concurrency());
+    placement.cpus.assign(1, {});
+    placement.slots.assign(threads, {0, -1});
+  }
+  return placement;
+}
+
+inline const Placement &placement() {
+  static const Placement instance = detect();
+  return instance;
+}
+
+inline size_t workerCount() { return placement().slots.size(); }
+
+// Node of the calling thread, 0 until it entered a slot.
+inline int &currentNode() {
+  thread_local int node = 0;
+  return node;
+}
+
+// Binds the calling thread to worker slot index.
+inline void enter(size_t index) {
+  const Slot &slot = placement().slots[index % placement().slots.size()];
+  currentNode() = slot.node;
+#ifdef __linux__
+  if (slot.cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(slot.cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+#endif
+}
+
+} // namespace numa
+} // namespace iq
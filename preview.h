@@ -0,0 +1,114 @@
+// preview.h - shared-memory framebuffer used by iq --preview and iqview
+//
+// The renderer publishes every tonemapped pass into one of two framebuffers
+// that follow the header in a POSIX shared-memory segment. The viewer maps
+// the segment, copies the front buffer and uses the sequence counter to
+// detect a publish that raced with the copy. Camera edits travel the other
+// way through a second sequence counter and reset the accumulation.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace iq {
+namespace preview {
+
+constexpr const char *segmentName = "/iq-preview";
+
+struct Header {
+  // Incremented after a new front buffer has been published.
+  std::atomic<uint32_t> sequence;
+  // Index (0 or 1) of the framebuffer holding the latest complete pass.
+  std::atomic<uint32_t> front;
+  uint32_t width;
+  uint32_t height;
+  uint32_t samples;
+
+  // Written by the viewer, odd while an edit is in progress.
+  std::atomic<uint32_t> cameraSequence;
+  float eye[3];
+  float at[3];
+
+  // Set by the viewer to end the interactive render.
+  std::atomic<uint32_t> stop;
+};
+
+inline size_t framebufferSize(uint32_t width, uint32_t height) {
+  return size_t(width) * size_t(height) * 3;
+}
+
+inline size_t segmentSize(uint32_t width, uint32_t height) {
+  return sizeof(Header) + 2 * framebufferSize(width, height);
+}
+
+inline uint8_t *framebuffer(Header *header, uint32_t index) {
+  return reinterpret_cast<uint8_t *>(header + 1) +
+         index * framebufferSize(header->width, header->height);
+}
+
+// Maps an existing segment, returns nullptr if there is no renderer.
+inline Header *open(size_t &size) {
+  const int fd = shm_open(segmentName, O_RDWR, 0);
+  if (fd < 0) {
+    return nullptr;
+  }
+  // Map the header alone first to learn the framebuffer dimensions.
+  void *memory =
+      mmap(nullptr, sizeof(Header), PROT_READ, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    close(fd);
+    return nullptr;
+  }
+  const Header *probe = static_cast<const Header *>(memory);
+  const uint32_t width = probe->width;
+  const uint32_t height = probe->height;
+  munmap(memory, sizeof(Header));
+  if (width == 0 || height == 0) {
+    // The renderer has not finished creating the segment yet.
+    close(fd);
+    return nullptr;
+  }
+  size = segmentSize(width, height);
+  memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return memory == MAP_FAILED ? nullptr : static_cast<Header *>(memory);
+}
+
+// Creates (or truncates) the segment for a width x height framebuffer.
+inline Header *create(uint32_t width, uint32_t height, size_t &size) {
+  const int fd = shm_open(segmentName, O_CREAT | O_RDWR, 0600);
+  if (fd < 0) {
+    return nullptr;
+  }
+  size = segmentSize(width, height);
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    return nullptr;
+  }
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+  Header *header = new (memory) Header();
+  header->width = width;
+  header->height = height;
+  return header;
+}
+
+inline void release(Header *header, size_t size) {
+  munmap(header, size);
+}
+
+// Removes the segment name, mappings stay valid until released.
+inline void unlink() { shm_unlink(segmentName); }
+
+} // namespace preview
+} // namespace iq
@@ -0,0 +1,189 @@
+// tests.cpp - checks run by ctest and the coverage target
+//
+// Builds main.cpp without its main() for access to the renderer's types.
+// Every check prints one line; the exit status is the number of failures.
+
+#define IQ_NO_MAIN
+#include "../main.cpp"
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const string &what) {
+  std::cout << (condition ? "pass " : "FAIL ") << what << std::endl;
+  failures += condition ? 0 : 1;
+}
+
+// Scattered rays leaving the radius 100 ground sphere must not hit it
+// again: it is convex and they leave into the hemisphere above it. Rays
+// started at the hit point itself, as before spawn(), are counted too.
+void selfIntersections() {
+  World world;
+  buildScene("spheres", world, "");
+  const Sphere &ground = world.sphere(0);
+  const float3 eye(0.0f, 2.0f, 3.0f);
+  const float tmin = numeric_limits<float>::min();
+  const float tmax = numeric_limits<float>::max();
+  const size_t count = 1000000;
+  size_t naive = 0, spawned = 0;
+  for (size_t i = 0; i < count; ++i) {
+    // Points on the ground around the spheres, seen from the camera.
+    const float3 target(-3.0f + 6.0f * iq::random(), -0.5f,
+                        -4.0f + 5.5f * iq::random());
+    const Ray ray(eye, normalize(target - eye));
+    float t;
+    if (!ground.intersect(ray, tmin, tmax, t)) {
+      continue;
+    }
+    const HitInfo info = ground.interaction(ray, t);
+    const float2 u(iq::random(), iq::random());
+    const float3 dir =
+        iq::Frame(info.normal).toWorld(iq::sampleCosineHemisphere(u));
+    naive += ground.intersect(Ray(info.p, dir), tmin, tmax, t) ? 1 : 0;
+    spawned += ground.intersect(info.spawn(dir, 0.0f), tmin, tmax, t) ? 1 : 0;
+  }
+  std::cout << "ground self-hits of " << count << " rays: " << naive
+            << " from the hit point, " << spawned << " spawned" << std::endl;
+  check(spawned == 0, "spawned rays do not re-hit the ground sphere");
+}
+
+// One pixel summed over a million samples per channel: uniform, sparse
+// bright outliers on a dim floor, and constant like the sky. The
+// compensated float sums have to stay within about float rounding of the
+// double sums, where plain float sums drift.
+void accumulation() {
+  const size_t samples = 1000000;
+  Accumulator accumulator(1);
+  accumulator.clear();
+  double3 exact(0.0);
+  float3 plain(0.0f);
+  std::mt19937 engine(1);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  for (size_t i = 0; i < samples; ++i) {
+    const float u = uniform(engine), v = uniform(engine);
+    const float3 value(u, v < 0.01f ? 1000.0f * u : 0.001f, 0.3f);
+    accumulator.add(0, value);
+    exact += double3(value);
+    plain += value;
+  }
+  const double3 sum = accumulator.sum(0);
+  for (int k = 0; k < 3; ++k) {
+    const double error = std::abs(sum[k] - exact[k]) / exact[k];
+    const double drift = std::abs(double(plain[k]) - exact[k]) / exact[k];
+    std::cout << "channel " << k << " relative error " << error
+              << ", plain float " << drift << std::endl;
+    check(error <= 1e-7, "compensated sum matches the double sum, channel " +
+                             std::to_string(k));
+  }
+}
+
+// Photons leave every emitter with its share of the power when the
+// environment and light spheres of different flux shine together: the
+// power per photon summed over the photons from each emitter matches the
+// emitter's flux.
+void photonEmission() {
+  World world;
+  world.setEnvironment(world.create<Environment>(Environment::gradient()));
+  const float radii[] = {0.05f, 0.1f, 0.2f, 0.3f};
+  const float radiances[] = {400.0f, 50.0f, 20.0f, 1.0f};
+  float3 lo(numeric_limits<float>::max()), hi(-lo);
+  for (int i = 0; i < 4; ++i) {
+    const float3 center(float(i), 0.0f, 0.0f);
+    world.add(Sphere(center, radii[i],
+                     world.create<DiffuseLight>(float3(radiances[i]))));
+    lo = linalg::min(lo, center - radii[i]);
+    hi = linalg::max(hi, center + radii[i]);
+  }
+  world.build();
+  vector<double> expected(5);
+  for (int i = 0; i < 4; ++i) {
+    expected[i] = 4.0 * iq::pi * iq::pi * radii[i] * radii[i] * radiances[i];
+  }
+  // Through a disk of the radius of the scene's bounding sphere.
+  const float radius = 0.5f * length(hi - lo);
+  expected[4] = iq::pi * radius * radius * world.environment().power();
+  const size_t count = 1000000;
+  vector<double> emitted(5, 0.0);
+  for (size_t n = 0; n < count; ++n) {
+    Ray ray;
+    float3 power;
+    if (!world.emitPhoton(ray, power)) {
+      check(false, "photons are emitted");
+      return;
+    }
+    // Light photons start on their sphere, environment ones outside all.
+    size_t emitter = 4;
+    for (int i = 0; i < 4; ++i) {
+      if (length(ray.org - world.sphere(uint32_t(i)).m_pos) <
+          1.001f * radii[i]) {
+        emitter = size_t(i);
+      }
+    }
+    emitted[emitter] += iq::luminance(power) / double(count);
+  }
+  for (size_t i = 0; i < emitted.size(); ++i) {
+    const double error = std::abs(emitted[i] - expected[i]) / expected[i];
+    std::cout << (i < 4 ? "light " + std::to_string(i) : "environment")
+              << " flux " << expected[i] << ", photons carry " << emitted[i]
+              << std::endl;
+    check(error < 0.03, "photon power matches the flux of emitter " +
+                            std::to_string(i));
+  }
+}
+
+// A light moving across the shutter interval is sampled and emits where it
+// is at the ray's time: light directions from a point above its path hit
+// the sphere at that time, and photons start on its surface then.
+void movingLight() {
+  World world;
+  world.setEnvironment(world.create<Environment>(Environment::gradient()));
+  Sphere light(float3(-2.0f, 0.0f, 0.0f), 0.25f,
+               world.create<DiffuseLight>(float3(10.0f)));
+  light.m_pos1 = float3(2.0f, 0.0f, 0.0f);
+  world.add(light);
+  world.build();
+  const Sphere &sphere = world.sphere(0);
+  const float3 p(0.0f, 1.0f, 0.0f), n(0.0f, -1.0f, 0.0f);
+  const size_t count = 100000;
+  size_t sampled = 0, missed = 0, misplaced = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const float time = iq::random();
+    const float3 u(iq::random(), iq::random(), iq::random());
+    float3 wi, radiance;
+    float pdf, distance;
+    if (world.sampleLight(p, n, time, u, wi, radiance, pdf, distance)) {
+      Ray ray(p, wi);
+      ray.time = time;
+      float t;
+      ++sampled;
+      missed += sphere.intersect(ray, 0.0f, numeric_limits<float>::max(), t)
+                    ? 0
+                    : 1;
+    }
+    Ray ray;
+    float3 power;
+    if (world.emitPhoton(ray, power) &&
+        length(ray.org - sphere.center(ray.time)) < 1.001f * sphere.m_radius) {
+      continue;
+    }
+    // Environment photons start outside the scene's bounds.
+    misplaced += length(ray.org) < 2.0f ? 1 : 0;
+  }
+  std::cout << "moving light: " << missed << " of " << sampled
+            << " light samples miss, " << misplaced << " photons misplaced"
+            << std::endl;
+  check(sampled > 0 && missed <= sampled / 1000,
+        "light samples hit the moving light at their time");
+  check(misplaced == 0, "photons start on the moving light at their time");
+}
+
+} // namespace
+
+int main() {
+  selfIntersections();
+  accumulation();
+  photonEmission();
+  movingLight();
+  return failures;
+}
@@ -0,0 +1,410 @@
+// texture.h - mip-mapped textures paged through a bounded tile cache
+//
+// Texture data is split into 32x32 texel tiles per mip level. Tiles are only
+// materialized when a lookup touches them: level 0 tiles are read from the
+// texture's source (a file or a procedural pattern) and every coarser tile is
+// box filtered from the four finer tiles below it, fetched through the cache
+// as well, so no level is ever built as a whole. Procedural sources fill
+// their coarse levels directly instead. Within a tile texels are
+// stored in Morton (Z) order, which keeps bilinear footprints in one or two
+// cache lines. The cache holds at most a fixed number of bytes; it is split
+// into shards, each guarded by its own mutex and evicting with the CLOCK
+// algorithm. Evicted tiles stay alive while a lookup still holds them.
+
+#pragma once
+
+#include "linalg.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace iq {
+namespace texture {
+
+using namespace linalg::aliases;
+
+constexpr int tileBits = 5;
+constexpr int tileSize = 1 << tileBits;
+
+// Interleaves the bits of x and y (both below tileSize).
+inline uint32_t morton(uint32_t x, uint32_t y) {
+  auto spread = [](uint32_t v) {
+    v = (v | (v << 8)) & 0x00ff00ffu;
+    v = (v | (v << 4)) & 0x0f0f0f0fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+  };
+  return spread(x) | (spread(y) << 1);
+}
+
+struct Tile {
+  float3 texels[tileSize * tileSize]; // Morton order
+  const float3 &at(uint32_t x, uint32_t y) const {
+    return texels[morton(x, y)];
+  }
+};
+
+// Level 0 texels of a texture.
+class Source {
+public:
+  virtual ~Source() {}
+  virtual size_t width() const = 0;
+  virtual size_t height() const = 0;
+  // Fills the w x h texels starting at (x, y), row by row.
+  virtual void read(size_t x, size_t y, size_t w, size_t h,
+                    float3 *texels) const = 0;
+  // Optionally fills texels of a coarser level directly; returning false
+  // has them box filtered from the level below.
+  virtual bool readLevel(int level, size_t x, size_t y, size_t w, size_t h,
+                         float3 *texels) const {
+    return false;
+  }
+};
+
+// Texels computed on demand from normalized coordinates, e.g. patterns
+// far larger than memory.
+class Procedural : public Source {
+public:
+  Procedural(size_t width, size_t height,
+             std::function<float3(float u, float v)> texel)
+      : m_width(width), m_height(height), m_texel(std::move(texel)) {}
+  size_t width() const override { return m_width; }
+  size_t height() const override { return m_height; }
+  void read(size_t x, size_t y, size_t w, size_t h,
+            float3 *texels) const override {
+    for (size_t j = 0; j < h; ++j) {
+      for (size_t i = 0; i < w; ++i) {
+        texels[i + j * w] = m_texel((float(x + i) + 0.5f) / float(m_width),
+                                    (float(y + j) + 0.5f) / float(m_height));
+      }
+    }
+  }
+  // Filtering down from level 0 would touch the whole pattern for the top
+  // levels, so from directLevel on texels average a grid of samples.
+  bool readLevel(int level, size_t x, size_t y, size_t w, size_t h,
+                 float3 *texels) const override {
+    if (level < directLevel) {
+      return false;
+    }
+    const float lw = float(std::max<size_t>(1, m_width >> level));
+    const float lh = float(std::max<size_t>(1, m_height >> level));
+    for (size_t j = 0; j < h; ++j) {
+      for (size_t i = 0; i < w; ++i) {
+        float3 sum(0.0f);
+        for (int b = 0; b < grid; ++b) {
+          for (int a = 0; a < grid; ++a) {
+            sum += m_texel((float(x + i) + (a + 0.5f) / grid) / lw,
+                           (float(y + j) + (b + 0.5f) / grid) / lh);
+          }
+        }
+        texels[i + j * w] = sum / float(grid * grid);
+      }
+    }
+    return true;
+  }
+
+private:
+  static constexpr int directLevel = 4;
+  static constexpr int grid = 8;
+  size_t m_width, m_height;
+  std::function<float3(float, float)> m_texel;
+};
+
+// Color or grayscale portable float map, little-endian. Only the header is
+// read up front; tiles seek to their rows, so files larger than the cache
+// budget are fine. Rows are stored bottom to top, v = 0 is the top row.
+class PfmFile : public Source {
+public:
+  static std::unique_ptr<PfmFile> open(const std::string &filename) {
+    FILE *file = std::fopen(filename.c_str(), "rb");
+    if (file == nullptr) {
+      return nullptr;
+    }
+    char type[3] = {};
+    unsigned long width = 0, height = 0;
+    float scale = 0.0f;
+    if (std::fscanf(file, "%2s %lu %lu %f", type, &width, &height, &scale) !=
+            4 ||
+        (std::string(type) != "PF" && std::string(type) != "Pf") ||
+        scale >= 0.0f || width == 0 || height == 0) {
+      std::fclose(file);
+      return nullptr;
+    }
+    std::fgetc(file); // single whitespace before the data
+    std::unique_ptr<PfmFile> pfm(new PfmFile());
+    pfm->m_file = file;
+    pfm->m_width = width;
+    pfm->m_height = height;
+    pfm->m_channels = type[1] == 'F' ? 3 : 1;
+    pfm->m_data = std::ftell(file);
+    return pfm;
+  }
+  ~PfmFile() override { std::fclose(m_file); }
+
+  size_t width() const override { return m_width; }
+  size_t height() const override { return m_height; }
+  void read(size_t x, size_t y, size_t w, size_t h,
+            float3 *texels) const override {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<float> row(w * m_channels);
+    for (size_t j = 0; j < h; ++j) {
+      const size_t fileRow = m_height - 1 - (y + j);
+      const long offset =
+          m_data + long((fileRow * m_width + x) * m_channels * sizeof(float));
+      if (std::fseek(m_file, offset, SEEK_SET) != 0 ||
+          std::fread(row.data(), sizeof(float), row.size(), m_file) !=
+              row.size()) {
+        std::fill(row.begin(), row.end(), 0.0f);
+      }
+      for (size_t i = 0; i < w; ++i) {
+        const float *p = &row[i * m_channels];
+        texels[i + j * w] =
+            m_channels == 3 ? float3(p[0], p[1], p[2]) : float3(p[0]);
+      }
+    }
+  }
+
+private:
+  PfmFile() {}
+  FILE *m_file = nullptr;
+  size_t m_width = 0, m_height = 0, m_channels = 3;
+  long m_data = 0;
+  mutable std::mutex m_mutex;
+};
+
+class Cache {
+public:
+  struct Stats {
+    uint64_t hits = 0, misses = 0, evictions = 0;
+  };
+
+  explicit Cache(size_t budget = size_t(256) << 20) { setBudget(budget); }
+
+  // Maximum bytes of tile data kept; only call while nothing is rendering.
+  void setBudget(size_t bytes) {
+    const size_t tiles = std::max<size_t>(shards, bytes / sizeof(Tile));
+    for (Shard &shard : m_shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.capacity = tiles / shards;
+      shard.entries.clear();
+      shard.index.clear();
+      shard.hand = 0;
+    }
+  }
+
+  // Returns the tile for key, calling load(tile) on a miss. load runs
+  // without any lock held and may itself fetch other tiles.
+  template <typename Load>
+  std::shared_ptr<const Tile> get(uint64_t key, const Load &load) {
+    Shard &shard = m_shards[(key * 0x9e3779b97f4a7c15ull) >> 58];
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto it = shard.index.find(key);
+      if (it != shard.index.end()) {
+        Entry &entry = shard.entries[it->second];
+        entry.referenced = true;
+        ++shard.stats.hits;
+        return entry.tile;
+      }
+    }
+    auto tile = std::make_shared<Tile>();
+    load(*tile);
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      // Another thread loaded it meanwhile.
+      ++shard.stats.hits;
+      return shard.entries[it->second].tile;
+    }
+    ++shard.stats.misses;
+    if (shard.entries.size() < shard.capacity) {
+      shard.index[key] = shard.entries.size();
+      shard.entries.push_back({key, tile, true});
+      return tile;
+    }
+    // CLOCK: clear reference bits until an unreferenced entry comes up.
+    for (;;) {
+      Entry &entry = shard.entries[shard.hand];
+      shard.hand = (shard.hand + 1) % shard.entries.size();
+      if (entry.referenced) {
+        entry.referenced = false;
+        continue;
+      }
+      shard.index.erase(entry.key);
+      shard.index[key] = size_t(&entry - shard.entries.data());
+      entry = {key, tile, true};
+      ++shard.stats.evictions;
+      return tile;
+    }
+  }
+
+  Stats stats() {
+    Stats total;
+    for (Shard &shard : m_shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      total.hits += shard.stats.hits;
+      total.misses += shard.stats.misses;
+      total.evictions += shard.stats.evictions;
+    }
+    return total;
+  }
+
+private:
+  static constexpr size_t shards = 64;
+
+  struct Entry {
+    uint64_t key;
+    std::shared_ptr<const Tile> tile;
+    bool referenced;
+  };
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, size_t> index;
+    std::vector<Entry> entries;
+    size_t hand = 0;
+    size_t capacity = 0;
+    Stats stats;
+  };
+
+  Shard m_shards[shards];
+};
+
+inline Cache &cache() {
+  static Cache instance;
+  return instance;
+}
+
+// Filtered lookups into a source. u wraps around, v is clamped.
+class Texture {
+public:
+  explicit Texture(std::unique_ptr<Source> source)
+      : m_source(std::move(source)), m_id(nextId()) {
+    size_t w = m_source->width(), h = m_source->height();
+    m_sizes.push_back({w, h});
+    while (w > 1 || h > 1) {
+      w = std::max<size_t>(1, w / 2);
+      h = std::max<size_t>(1, h / 2);
+      m_sizes.push_back({w, h});
+    }
+  }
+
+  // Trilinear lookup; width is the footprint of the lookup in u.
+  float3 sample(const float2 &uv, float width) const {
+    const float lod = std::log2(std::max(width * float(m_sizes[0].width),
+                                         1.0f));
+    const int last = int(m_sizes.size()) - 1;
+    const int level = std::min(int(lod), last);
+    const float t = level == last ? 0.0f : lod - float(level);
+    float3 value = bilinear(level, uv);
+    if (t > 0.0f) {
+      value = value + (bilinear(level + 1, uv) - value) * t;
+    }
+    return value;
+  }
+
+  size_t levels() const { return m_sizes.size(); }
+
+private:
+  struct Size {
+    size_t width, height;
+  };
+
+  static uint16_t nextId() {
+    static std::atomic<uint16_t> id(0);
+    return id++;
+  }
+
+  float3 bilinear(int level, const float2 &uv) const {
+    const Size &size = m_sizes[level];
+    const float x = (uv.x - std::floor(uv.x)) * float(size.width) - 0.5f;
+    const float y = std::clamp(uv.y, 0.0f, 1.0f) * float(size.height) - 0.5f;
+    const float fx = std::floor(x), fy = std::floor(y);
+    const long x0 = long(fx), y0 = long(fy);
+    const float tx = x - fx, ty = y - fy;
+    Lookup lookup{this, level};
+    const float3 a = lookup(x0, y0), b = lookup(x0 + 1, y0);
+    const float3 c = lookup(x0, y0 + 1), d = lookup(x0 + 1, y0 + 1);
+    return (a * (1.0f - tx) + b * tx) * (1.0f - ty) +
+           (c * (1.0f - tx) + d * tx) * ty;
+  }
+
+  // Texel fetches that keep the last tile to skip the cache when
+  // neighbouring texels share it.
+  struct Lookup {
+    const Texture *texture;
+    int level;
+    uint64_t key = ~uint64_t(0);
+    std::shared_ptr<const Tile> tile;
+
+    float3 operator()(long x, long y) {
+      const Size &size = texture->m_sizes[level];
+      const long w = long(size.width), h = long(size.height);
+      x = ((x % w) + w) % w;
+      y = std::clamp(y, 0L, h - 1);
+      const uint64_t k = texture->key(level, size_t(x) >> tileBits,
+                                      size_t(y) >> tileBits);
+      if (k != key) {
+        key = k;
+        tile = texture->tile(level, size_t(x) >> tileBits,
+                             size_t(y) >> tileBits);
+      }
+      return tile->at(uint32_t(x) & (tileSize - 1),
+                      uint32_t(y) & (tileSize - 1));
+    }
+  };
+
+  uint64_t key(int level, size_t tx, size_t ty) const {
+    return uint64_t(m_id) << 48 | uint64_t(level) << 40 |
+           uint64_t(ty) << 20 | uint64_t(tx);
+  }
+
+  std::shared_ptr<const Tile> tile(int level, size_t tx, size_t ty) const {
+    return cache().get(key(level, tx, ty), [&](Tile &tile) {
+      const Size &size = m_sizes[level];
+      const size_t x0 = tx * tileSize, y0 = ty * tileSize;
+      const size_t w = std::min<size_t>(tileSize, size.width - x0);
+      const size_t h = std::min<size_t>(tileSize, size.height - y0);
+      std::vector<float3> texels(w * h);
+      if (level == 0) {
+        m_source->read(x0, y0, w, h, texels.data());
+      } else if (!m_source->readLevel(level, x0, y0, w, h, texels.data())) {
+        // 2x2 box filter of the finer level.
+        Lookup finer{this, level - 1};
+        for (size_t j = 0; j < h; ++j) {
+          for (size_t i = 0; i < w; ++i) {
+            const long x = long(2 * (x0 + i)), y = long(2 * (y0 + j));
+            texels[i + j * w] = 0.25f * (finer(x, y) + finer(x + 1, y) +
+                                         finer(x, y + 1) +
+                                         finer(x + 1, y + 1));
+          }
+        }
+      }
+      // Texels outside the level repeat its edge.
+      for (uint32_t j = 0; j < tileSize; ++j) {
+        for (uint32_t i = 0; i < tileSize; ++i) {
+          tile.texels[morton(i, j)] =
+              texels[std::min<size_t>(i, w - 1) +
+                     std::min<size_t>(j, h - 1) * w];
+        }
+      }
+    });
+  }
+
+  std::unique_ptr<Source> m_source;
+  uint16_t m_id;
+  std::vector<Size> m_sizes;
+};
+
+} // namespace texture
+} // namespace iq
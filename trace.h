@@ -0,0 +1,162 @@
+// trace.h - scoped timing zones exported in Chrome trace event format
+//
+// A Zone records its name, start and duration into a ring buffer owned by
+// the calling thread. Buffers are handed back to a pool when a thread exits
+// and reused by the next one, so every buffer becomes one lane of the trace
+// (the worker slot) and memory stays bounded however many short-lived
+// threads run. When tracing is disabled a zone costs one branch.
+//
+// Load the exported file in chrome://tracing or https://ui.perfetto.dev.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace iq {
+namespace trace {
+
+struct Event {
+  const char *name;
+  int64_t arg;
+  uint64_t begin; // nanoseconds since enable()
+  uint64_t duration;
+};
+
+// Fixed capacity buffer keeping the most recent events.
+class Ring {
+public:
+  explicit Ring(size_t capacity) : m_events(capacity) {}
+  void push(const Event &event) {
+    m_events[m_count++ % m_events.size()] = event;
+  }
+  template <typename F> void forEach(const F &f) const {
+    const size_t n = std::min(m_count, m_events.size());
+    for (size_t i = m_count - n; i < m_count; ++i) {
+      f(m_events[i % m_events.size()]);
+    }
+  }
+
+private:
+  std::vector<Event> m_events;
+  size_t m_count = 0;
+};
+
+struct State {
+  bool enabled = false;
+  size_t capacity = 1 << 16;
+  std::chrono::steady_clock::time_point epoch;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Ring>> rings;
+  std::vector<size_t> free;
+};
+
+inline State &state() {
+  static State instance;
+  return instance;
+}
+
+// Starts recording; call before any worker threads are started.
+inline void enable(size_t capacity = 1 << 16) {
+  State &s = state();
+  s.enabled = true;
+  s.capacity = capacity;
+  s.epoch = std::chrono::steady_clock::now();
+}
+
+inline bool enabled() { return state().enabled; }
+
+inline uint64_t now() {
+  return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - state().epoch)
+                      .count());
+}
+
+// Binds a pooled ring to the calling thread for the thread's lifetime.
+class Lane {
+public:
+  Lane() {
+    State &s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.free.empty()) {
+      m_index = s.rings.size();
+      s.rings.push_back(std::make_unique<Ring>(s.capacity));
+    } else {
+      m_index = s.free.back();
+      s.free.pop_back();
+    }
+    m_ring = s.rings[m_index].get();
+  }
+  ~Lane() {
+    State &s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.free.push_back(m_index);
+  }
+  Ring &ring() { return *m_ring; }
+
+private:
+  size_t m_index;
+  Ring *m_ring;
+};
+
+inline Ring &ring() {
+  thread_local Lane lane;
+  return lane.ring();
+}
+
+class Zone {
+public:
+  explicit Zone(const char *name, int64_t arg = -1)
+      : m_name(name), m_arg(arg), m_begin(enabled() ? now() : 0) {}
+  ~Zone() { end(); }
+  // Closes the zone before the end of its scope.
+  void end() {
+    if (m_name != nullptr && enabled()) {
+      ring().push({m_name, m_arg, m_begin, now() - m_begin});
+    }
+    m_name = nullptr;
+  }
+  Zone(const Zone &) = delete;
+  Zone &operator=(const Zone &) = delete;
+
+private:
+  const char *m_name;
+  int64_t m_arg;
+  uint64_t m_begin;
+};
+
+// Writes all recorded events as a JSON array of complete ("X") events, one
+// thread id per lane. Call once the traced threads have finished.
+inline bool write(const std::string &filename) {
+  State &s = state();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  std::ofstream file(filename);
+  file << std::fixed;
+  file.precision(3);
+  file << "[";
+  bool first = true;
+  for (size_t lane = 0; lane < s.rings.size(); ++lane) {
+    s.rings[lane]->forEach([&](const Event &e) {
+      file << (first ? "\n" : ",\n") << "{\"name\":\"" << e.name
+           << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << lane
+           << ",\"ts\":" << e.begin / 1000.0
+           << ",\"dur\":" << e.duration / 1000.0;
+      if (e.arg >= 0) {
+        file << ",\"args\":{\"arg\":" << e.arg << "}";
+      }
+      file << "}";
+      first = false;
+    });
+  }
+  file << "\n]\n";
+  return bool(file);
+}
+
+} // namespace trace
+} // namespace iq
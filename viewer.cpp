@@ -0,0 +1,172 @@
+#include "linalg.h"
+#include "preview.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/ioctl.h>
+#include <termios.h>
+
+using namespace std;
+using namespace linalg::aliases;
+
+// Minimal terminal viewer for iq --preview. Draws the shared framebuffer with
+// 24-bit color half blocks and sends camera edits back to the renderer:
+//   w/s  dolly towards/away from the target
+//   a/d  orbit around the target
+//   r/f  raise/lower the eye
+//   q    stop the renderer and quit
+
+namespace {
+
+struct Terminal {
+  termios saved;
+  Terminal() {
+    tcgetattr(STDIN_FILENO, &saved);
+    termios raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    std::cout << "\x1b[?25l\x1b[2J";
+  }
+  ~Terminal() {
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    std::cout << "\x1b[0m\x1b[?25h" << std::endl;
+  }
+  static int2 size() {
+    winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_col == 0) {
+      return int2(80, 24);
+    }
+    return int2(ws.ws_col, ws.ws_row);
+  }
+};
+
+// Copies the front buffer, retrying if the renderer published meanwhile.
+uint32_t snapshot(iq::preview::Header *header, vector<uint8_t> &pixels) {
+  pixels.resize(iq::preview::framebufferSize(header->width, header->height));
+  for (;;) {
+    const uint32_t sequence = header->sequence.load(std::memory_order_acquire);
+    const uint32_t front = header->front.load(std::memory_order_acquire);
+    std::memcpy(pixels.data(), iq::preview::framebuffer(header, front),
+                pixels.size());
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header->sequence.load(std::memory_order_relaxed) == sequence) {
+      return sequence;
+    }
+  }
+}
+
+void draw(const iq::preview::Header *header, const vector<uint8_t> &pixels) {
+  const int2 terminal = Terminal::size();
+  const int columns = terminal.x;
+  const int rows = std::max(1, terminal.y - 1);
+  const float scale = std::max(float(header->width) / columns,
+                               float(header->height) / (2.0f * rows));
+  const int w = int(header->width / scale);
+  const int h = int(header->height / scale) / 2;
+
+  auto pixel = [&](int x, int y) {
+    const size_t px = std::min<size_t>(size_t(x * scale), header->width - 1);
+    const size_t py = std::min<size_t>(size_t(y * scale), header->height - 1);
+    return &pixels[3 * (px + py * header->width)];
+  };
+
+  string frame = "\x1b[H";
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      const uint8_t *top = pixel(x, 2 * y);
+      const uint8_t *bottom = pixel(x, 2 * y + 1);
+      frame += "\x1b[38;2;" + to_string(top[0]) + ";" + to_string(top[1]) +
+               ";" + to_string(top[2]) + "m\x1b[48;2;" + to_string(bottom[0]) +
+               ";" + to_string(bottom[1]) + ";" + to_string(bottom[2]) +
+               "m\xe2\x96\x80";
+    }
+    frame += "\x1b[0m\n";
+  }
+  frame += "samples " + to_string(header->samples) +
+           "  [wasdrf] camera [q] quit";
+  std::cout << frame << std::flush;
+}
+
+bool edit(iq::preview::Header *header, char key) {
+  float3 eye(header->eye[0], header->eye[1], header->eye[2]);
+  const float3 at(header->at[0], header->at[1], header->at[2]);
+  float3 offset = eye - at;
+
+  const float step = 0.1f;
+  switch (key) {
+  case 'w':
+    offset *= 1.0f - step;
+    break;
+  case 's':
+    offset *= 1.0f + step;
+    break;
+  case 'a':
+  case 'd': {
+    const float angle = key == 'a' ? -step : step;
+    offset = float3(offset.x * cos(angle) - offset.z * sin(angle), offset.y,
+                    offset.x * sin(angle) + offset.z * cos(angle));
+    break;
+  }
+  case 'r':
+    offset.y += step * length(offset);
+    break;
+  case 'f':
+    offset.y -= step * length(offset);
+    break;
+  default:
+    return false;
+  }
+  eye = at + offset;
+
+  // Odd sequence numbers mark an edit in progress.
+  header->cameraSequence.fetch_add(1, std::memory_order_acq_rel);
+  std::memcpy(header->eye, &eye, sizeof(header->eye));
+  header->cameraSequence.fetch_add(1, std::memory_order_release);
+  return true;
+}
+
+} // namespace
+
+int main() {
+  size_t size = 0;
+  iq::preview::Header *header = nullptr;
+  while ((header = iq::preview::open(size)) == nullptr) {
+    std::cerr << "Waiting for iq --preview..." << std::endl;
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+
+  {
+    Terminal terminal;
+    vector<uint8_t> pixels;
+    uint32_t shown = ~0u;
+    bool running = true;
+    while (running) {
+      char key;
+      bool dirty = false;
+      while (read(STDIN_FILENO, &key, 1) == 1) {
+        if (key == 'q') {
+          header->stop.store(1, std::memory_order_release);
+          running = false;
+        } else {
+          dirty |= edit(header, key);
+        }
+      }
+      if (header->sequence.load(std::memory_order_acquire) != shown || dirty) {
+        shown = snapshot(header, pixels);
+        draw(header, pixels);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    }
+  }
+
+  iq::preview::release(header, size);
+  return 0;
+}